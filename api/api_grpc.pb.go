@@ -19,7 +19,8 @@ import (
 const _ = grpc.SupportPackageIsVersion7
 
 const (
-	Rank_Rank_FullMethodName = "/api.Rank/Rank"
+	Rank_Rank_FullMethodName     = "/api.Rank/Rank"
+	Rank_Retrieve_FullMethodName = "/api.Rank/Retrieve"
 )
 
 // RankClient is the client API for Rank service.
@@ -27,6 +28,7 @@ const (
 // For semantics around ctx use and closing/ending streaming RPCs, please refer to https://pkg.go.dev/google.golang.org/grpc/?tab=doc#ClientConn.NewStream.
 type RankClient interface {
 	Rank(ctx context.Context, in *Request, opts ...grpc.CallOption) (*Response, error)
+	Retrieve(ctx context.Context, in *Request, opts ...grpc.CallOption) (*Response, error)
 }
 
 type rankClient struct {
@@ -46,11 +48,21 @@ func (c *rankClient) Rank(ctx context.Context, in *Request, opts ...grpc.CallOpt
 	return out, nil
 }
 
+func (c *rankClient) Retrieve(ctx context.Context, in *Request, opts ...grpc.CallOption) (*Response, error) {
+	out := new(Response)
+	err := c.cc.Invoke(ctx, Rank_Retrieve_FullMethodName, in, out, opts...)
+	if err != nil {
+		return nil, err
+	}
+	return out, nil
+}
+
 // RankServer is the server API for Rank service.
 // All implementations must embed UnimplementedRankServer
 // for forward compatibility
 type RankServer interface {
 	Rank(context.Context, *Request) (*Response, error)
+	Retrieve(context.Context, *Request) (*Response, error)
 	mustEmbedUnimplementedRankServer()
 }
 
@@ -61,6 +73,9 @@ type UnimplementedRankServer struct {
 func (UnimplementedRankServer) Rank(context.Context, *Request) (*Response, error) {
 	return nil, status.Errorf(codes.Unimplemented, "method Rank not implemented")
 }
+func (UnimplementedRankServer) Retrieve(context.Context, *Request) (*Response, error) {
+	return nil, status.Errorf(codes.Unimplemented, "method Retrieve not implemented")
+}
 func (UnimplementedRankServer) mustEmbedUnimplementedRankServer() {}
 
 // UnsafeRankServer may be embedded to opt out of forward compatibility for this service.
@@ -92,6 +107,24 @@ func _Rank_Rank_Handler(srv interface{}, ctx context.Context, dec func(interface
 	return interceptor(ctx, in, info, handler)
 }
 
+func _Rank_Retrieve_Handler(srv interface{}, ctx context.Context, dec func(interface{}) error, interceptor grpc.UnaryServerInterceptor) (interface{}, error) {
+	in := new(Request)
+	if err := dec(in); err != nil {
+		return nil, err
+	}
+	if interceptor == nil {
+		return srv.(RankServer).Retrieve(ctx, in)
+	}
+	info := &grpc.UnaryServerInfo{
+		Server:     srv,
+		FullMethod: Rank_Retrieve_FullMethodName,
+	}
+	handler := func(ctx context.Context, req interface{}) (interface{}, error) {
+		return srv.(RankServer).Retrieve(ctx, req.(*Request))
+	}
+	return interceptor(ctx, in, info, handler)
+}
+
 // Rank_ServiceDesc is the grpc.ServiceDesc for Rank service.
 // It's only intended for direct use with grpc.RegisterService,
 // and not to be introspected or modified (even as a copy)
@@ -103,6 +136,10 @@ var Rank_ServiceDesc = grpc.ServiceDesc{
 			MethodName: "Rank",
 			Handler:    _Rank_Rank_Handler,
 		},
+		{
+			MethodName: "Retrieve",
+			Handler:    _Rank_Retrieve_Handler,
+		},
 	},
 	Streams:  []grpc.StreamDesc{},
 	Metadata: "api.proto",
@@ -21,21 +21,115 @@ type EnvConfig struct {
 const POOL_KEY_FORMAT = "/pools/%s"
 const MODEL_KEY_FORMAT = "/longmen/models/%s"
 
+const (
+	KeyTypeString = "string"
+	KeyTypeUint64 = "uint64"
+)
+
+// huge page policy of the pool and the input workspaces
+const (
+	HugePageOff     = "off"
+	HugePageMadvise = "madvise"
+	HugePageHugetlb = "hugetlb"
+)
+
+// storage of the float item features in the pool
+const (
+	FloatStoreFp32 = "fp32"
+	FloatStoreFp16 = "fp16"
+	FloatStoreBf16 = "bf16"
+	FloatStoreInt8 = "int8"
+)
+
+// placement of the pool on multi socket hosts
+const (
+	NumaOff        = "off"
+	NumaInterleave = "interleave"
+	NumaReplicate  = "replicate"
+)
+
 type PoolConfig struct {
 	Path    string `json:"path" toml:"path" yaml:"path"`
 	Key     string `json:"key" toml:"key" yaml:"key"`
+	KeyType string `json:"key_type" toml:"key_type" yaml:"key_type"`
 	Version string `json:"version" toml:"version" yaml:"version"`
+	// categorical item features indexed for the request filter
+	Attributes []string `json:"attributes" toml:"attributes" yaml:"attributes"`
+	HugePage   string   `json:"huge_page" toml:"huge_page" yaml:"huge_page"`
+	Numa       string   `json:"numa" toml:"numa" yaml:"numa"`
+	FloatStore string   `json:"float_store" toml:"float_store" yaml:"float_store"`
+	// directory of the processed pool cache, keyed by the pool and toolkit
+	// contents, off when empty
+	CacheDir string `json:"cache_dir" toml:"cache_dir" yaml:"cache_dir"`
+	// processed items kept by a lazy pool, which processes every item on
+	// its first lookup, at least 64. 0 processes the whole pool at load
+	LazyRows int `json:"lazy_rows" toml:"lazy_rows" yaml:"lazy_rows"`
+}
+
+// AnnConfig enables the hnsw index used to retrieve from the whole pool
+// with two tower models, it is built when M > 0
+type AnnConfig struct {
+	M              int `json:"m" toml:"m" yaml:"m"`
+	EfConstruction int `json:"ef_construction" toml:"ef_construction" yaml:"ef_construction"`
+	Ef             int `json:"ef" toml:"ef" yaml:"ef"`
 }
 
+// precision of the model, auto is bf16 on cpus with bf16 instructions
+const (
+	PrecisionFp32 = "fp32"
+	PrecisionBf16 = "bf16"
+	PrecisionAuto = "auto"
+)
+
+// inference runtime of the model, empty picks onnx for `.onnx` files and
+// torchscript otherwise
+const (
+	BackendTorchScript = "torchscript"
+	BackendOnnx        = "onnx"
+)
+
+// how threads pick a model replica
+const (
+	ReplicaPolicyCore       = "core"
+	ReplicaPolicyRoundRobin = "round_robin"
+)
+
 type ModelConfig struct {
-	Path    string `json:"path" toml:"path" yaml:"path"`
-	Kit     string `json:"kit" toml:"kit" yaml:"kit"`
-	Version string `json:"version" toml:"version" yaml:"version"`
+	Path string `json:"path" toml:"path" yaml:"path"`
+	// int8 variant of the model made by third/longmen/tools/quantize.py,
+	// served instead of Path when set
+	Quantized string `json:"quantized" toml:"quantized" yaml:"quantized"`
+	Kit       string `json:"kit" toml:"kit" yaml:"kit"`
+	Version   string `json:"version" toml:"version" yaml:"version"`
+	Precision string `json:"precision" toml:"precision" yaml:"precision"`
+	Backend   string `json:"backend" toml:"backend" yaml:"backend"`
+	// torchscript module replicas sharing the weights, 0 or 1 shares a
+	// single module between all threads
+	Replicas      int       `json:"replicas" toml:"replicas" yaml:"replicas"`
+	ReplicaPolicy string    `json:"replica_policy" toml:"replica_policy" yaml:"replica_policy"`
+	Ann           AnnConfig `json:"ann" toml:"ann" yaml:"ann"`
+}
+
+// ShadowConfig scores a sampled fraction of the live requests of one
+// model with a candidate model, off the request path
+type ShadowConfig struct {
+	Model ModelConfig `json:"model" toml:"model" yaml:"model"`
+	// model id of the mirrored requests
+	ModelId string `json:"model_id" toml:"model_id" yaml:"model_id"`
+	// fraction of the requests mirrored, 0 turns the shadow off
+	Sample float64 `json:"sample" toml:"sample" yaml:"sample"`
+	// mirrored requests waiting for the shadow model, the others are dropped
+	Queue   int `json:"queue" toml:"queue" yaml:"queue"`
+	Workers int `json:"workers" toml:"workers" yaml:"workers"`
 }
 
 type PoolModelConfig struct {
 	ModelConfig `json:"model" toml:"model" yaml:"model"`
 	PoolConfig  `json:"pool" toml:"pool" yaml:"pool"`
+	// more models over the same pool, by the model id of the requests they
+	// serve. the model above serves the requests without a model id
+	Models map[string]ModelConfig `json:"models" toml:"models" yaml:"models"`
+	Shadow ShadowConfig           `json:"shadow" toml:"shadow" yaml:"shadow"`
 }
 type RemoteConfig struct {
 	Pool  string `json:"pool" toml:"pool" yaml:"pool"`
@@ -45,10 +139,16 @@ type LocalConfig struct {
 	PoolModelFile string `json:"config_file" toml:"config_file" yaml:"config_file"`
 }
 
+// DefaultMaxTopK bounds the topK of retrieve requests when max_top_k is
+// not configured
+const DefaultMaxTopK = 1000
+
 type AppConfig struct {
 	commonconfig.ServerConfig `json:"server" toml:"server" yaml:"server"`
 	EnvConfig                 `json:"env" toml:"env" yaml:"env"`
 	Mode                      string `json:"mode" toml:"mode" yaml:"mode"`
+	// largest topK of a retrieve request, larger ones are clamped to it
+	MaxTopK int `json:"max_top_k" toml:"max_top_k" yaml:"max_top_k"`
 
 	RemoteConfig `json:"remote" toml:"remote" yaml:"remote"`
 	LocalConfig  `json:"local" toml:"local" yaml:"local"`
@@ -140,6 +240,14 @@ func (conf *AppConfig) GetPoolModelConfig() (*PoolModelConfig, error) {
 
 var AppConfigInstance AppConfig
 
+// TopKLimit is the configured max_top_k, or DefaultMaxTopK
+func (conf *AppConfig) TopKLimit() int {
+	if conf.MaxTopK > 0 {
+		return conf.MaxTopK
+	}
+	return DefaultMaxTopK
+}
+
 func (conf *AppConfig) Init(filePath string) {
 	fData, err := os.ReadFile(filePath)
 	if err != nil {
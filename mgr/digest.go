@@ -0,0 +1,109 @@
+package mgr
+
+import (
+	"crypto/sha256"
+	"encoding/hex"
+	"fmt"
+	"io"
+	"os"
+	"path/filepath"
+	"sort"
+	"strconv"
+	"strings"
+	"time"
+
+	"github.com/uopensail/longmen/config"
+)
+
+// poolCacheKeep is how many processed pools stay in the cache directory,
+// the older ones are removed
+const poolCacheKeep = 4
+
+// staleTempAge is when a file written aside by the library is taken for the
+// leftover of a crashed writer and removed
+const staleTempAge = time.Hour
+
+// removeStaleTemps removes the leftovers of writers that died before
+// renaming their file into place
+func removeStaleTemps(pattern string) {
+	files, err := filepath.Glob(pattern)
+	if err != nil {
+		return
+	}
+	for _, file := range files {
+		if info, err := os.Stat(file); err == nil && time.Since(info.ModTime()) > staleTempAge {
+			os.Remove(file)
+		}
+	}
+}
+
+// fileDigest hashes the contents of the files, so a version bump without
+// new contents does not reload anything
+func fileDigest(paths ...string) (string, error) {
+	h := sha256.New()
+	for _, path := range paths {
+		fd, err := os.Open(path)
+		if err != nil {
+			return "", err
+		}
+		_, err = io.Copy(h, fd)
+		fd.Close()
+		if err != nil {
+			return "", err
+		}
+	}
+	return hex.EncodeToString(h.Sum(nil)), nil
+}
+
+// loadDigest covers the load options of the pool and the model, a version
+// bump with the same files but other options still reloads. the paths and
+// versions are left out, the file digests stand for them
+func loadDigest(pconf *config.PoolConfig, mconf *config.ModelConfig) string {
+	p, m := *pconf, *mconf
+	p.Path, p.Version = "", ""
+	m.Path, m.Quantized, m.Kit, m.Version = "", "", "", ""
+	return fmt.Sprintf("%+v|%+v", p, m)
+}
+
+// poolHash is the 64 bit pool hash handed to the library from the pool
+// digest, so the multi GB pool file is not read again to hash it. 0 lets
+// the library hash the file itself
+func poolHash(digest string) uint64 {
+	if len(digest) < 16 {
+		return 0
+	}
+	h, err := strconv.ParseUint(digest[:16], 16, 64)
+	if err != nil {
+		return 0
+	}
+	return h
+}
+
+// prunePoolCache keeps the most recently written processed pools
+func prunePoolCache(dir string) {
+	removeStaleTemps(filepath.Join(dir, "pool-*.cache.*.tmp"))
+	keepNewest(filepath.Join(dir, "pool-*.cache"), ".cache", poolCacheKeep)
+}
+
+// keepNewest removes all but the keep most recently written files of the
+// pattern ending in suffix
+func keepNewest(pattern, suffix string, keep int) {
+	files, err := filepath.Glob(pattern)
+	if err != nil || len(files) <= keep {
+		return
+	}
+	mtimes := make(map[string]int64, len(files))
+	for _, file := range files {
+		if info, err := os.Stat(file); err == nil {
+			mtimes[file] = info.ModTime().UnixNano()
+		}
+	}
+	sort.Slice(files, func(i, j int) bool {
+		return mtimes[files[i]] > mtimes[files[j]]
+	})
+	for _, file := range files[keep:] {
+		if strings.HasSuffix(file, suffix) {
+			os.Remove(file)
+		}
+	}
+}
@@ -1,8 +1,10 @@
 package mgr
 
 import (
+	"errors"
 	"os"
 	"path/filepath"
+	"sync"
 	"sync/atomic"
 	"time"
 	"unsafe"
@@ -12,25 +14,75 @@ import (
 	_ "github.com/spf13/viper/remote"
 	"github.com/uopensail/longmen/wrapper"
 	"github.com/uopensail/ulib/finder"
-	"github.com/uopensail/ulib/prome"
 	"github.com/uopensail/ulib/utils"
 	"github.com/uopensail/ulib/zlog"
 	"go.uber.org/zap"
 )
 
+// DefaultModelId is the id of the [model] config, it serves the requests
+// without a model id
+const DefaultModelId = ""
+
 type Manager struct {
-	ins    *wrapper.Wrapper
-	curCfg config.PoolModelConfig
+	// *map[string]*wrapper.Handle by model id, replaced as a whole when a
+	// model is added or removed
+	handles unsafe.Pointer
+	// the pool file on disk, and the pool version each model id was
+	// loaded over. a model that failed to load over a new pool is retried
+	// on the next tick, whatever the others did
+	curPool         config.PoolConfig
+	curPoolVersions map[string]string
+	curCfgs         map[string]config.ModelConfig
+	// contents of the served files, the pool and the model and toolkit of
+	// each model id
+	curPoolDigest string
+	curDigests    map[string]string
+	// *shadow, nil until a shadow model is configured
+	shadow          unsafe.Pointer
+	curShadow       config.ModelConfig
+	curShadowPool   string
+	curShadowDigest string
+	// handles removed from the config, freed on the next tick once no
+	// request that resolved them before the removal can still be using them
+	retired []*wrapper.Handle
+}
+
+func (mgr *Manager) getShadow() *shadow {
+	return (*shadow)(atomic.LoadPointer(&mgr.shadow))
+}
+
+// Mirror offers a ranked request to the shadow model. It never blocks,
+// the sampled requests are scored again later on other goroutines.
+// ctx stays owned by the caller.
+func (mgr *Manager) Mirror(ctx *wrapper.UserContext, request *MirrorRequest) {
+	if s := mgr.getShadow(); s != nil {
+		s.offer(ctx, request)
+	}
+}
+
+func (mgr *Manager) getHandles() map[string]*wrapper.Handle {
+	return *(*map[string]*wrapper.Handle)(atomic.LoadPointer(&mgr.handles))
 }
 
-func (mgr *Manager) getInfer() *wrapper.Wrapper {
-	ret := (*wrapper.Wrapper)(atomic.LoadPointer((*unsafe.Pointer)(unsafe.Pointer(&mgr.ins))))
-	return ret
+// GetHandle resolves the model id of a request, requests for unknown ids
+// are rejected before any per model work is done
+func (mgr *Manager) GetHandle(modelId string) (*wrapper.Handle, error) {
+	handle, ok := mgr.getHandles()[modelId]
+	if !ok {
+		return nil, errors.New("unknown model id: " + modelId)
+	}
+	return handle, nil
 }
 
 func (mgr *Manager) Init(envCfg config.EnvConfig, jobUtil *utils.MetuxJobUtil) {
+	handles := map[string]*wrapper.Handle{DefaultModelId: wrapper.NewHandle()}
+	atomic.StorePointer(&mgr.handles, unsafe.Pointer(&handles))
+	mgr.curCfgs = make(map[string]config.ModelConfig)
+	mgr.curPoolVersions = make(map[string]string)
+	mgr.curDigests = make(map[string]string)
 
 	mgr.cronJob(envCfg, jobUtil)
+	go mgr.reportPools()
 }
 
 func (mgr *Manager) cronJob(envCfg config.EnvConfig, jobUtil *utils.MetuxJobUtil) {
@@ -53,63 +105,289 @@ func (mgr *Manager) downloadFile(envCfg config.EnvConfig, src, dst string) error
 	_, err := dw.Download(src, dst)
 	return err
 }
+
+// downloadModel fetches the quantized variant of the model when one is
+// configured, falling back to the fp32 model if that fails
+func (mgr *Manager) downloadModel(envCfg config.EnvConfig, dir string, mconf *config.ModelConfig) (string, error) {
+	if len(mconf.Quantized) > 0 {
+		modelPath := getPath(envCfg.WorkDir, dir, mconf.Quantized)
+		err := mgr.downloadFile(envCfg, mconf.Quantized, modelPath)
+		if err == nil {
+			return modelPath, nil
+		}
+		zlog.LOG.Error("Manager.downloadModel quantized", zap.Error(err))
+	}
+	modelPath := getPath(envCfg.WorkDir, dir, mconf.Path)
+	err := mgr.downloadFile(envCfg, mconf.Path, modelPath)
+	return modelPath, err
+}
+
+// modelFiles are the local files of one model
+type modelFiles struct {
+	modelPath string
+	lubanPath string
+	err       error
+}
+
+// downloadModelFiles fetches the model and its toolkit config side by side
+func (mgr *Manager) downloadModelFiles(envCfg config.EnvConfig, dir string, mconf *config.ModelConfig) modelFiles {
+	var files modelFiles
+	var kitErr error
+	var wg sync.WaitGroup
+	wg.Add(1)
+	go func() {
+		defer wg.Done()
+		files.lubanPath = getPath(envCfg.WorkDir, dir, mconf.Kit)
+		kitErr = mgr.downloadFile(envCfg, mconf.Kit, files.lubanPath)
+	}()
+	files.modelPath, files.err = mgr.downloadModel(envCfg, dir, mconf)
+	wg.Wait()
+	if files.err == nil {
+		files.err = kitErr
+	}
+	return files
+}
+
 func getPath(workDir, dir, src string) string {
 	poolDir := filepath.Join(workDir, dir)
 	os.MkdirAll(poolDir, os.ModePerm)
 	return filepath.Join(poolDir, filepath.Base(src))
 }
 
-// Do not modify the execution order
+// modelDir keeps the files of every model apart, their names may clash
+func modelDir(modelId string) string {
+	if modelId == DefaultModelId {
+		return "model"
+	}
+	return filepath.Join("models", modelId)
+}
+
+// loadAllJob returns the job reloading what changed in the config, nil if
+// nothing did. The files download concurrently but the models load one
+// after the other: the first one over a new pool processes it and the
+// others find it shared, where concurrent loads would each process a copy.
 func (mgr *Manager) loadAllJob(envCfg config.EnvConfig) func() {
+	for _, handle := range mgr.retired {
+		handle.Close()
+	}
+	mgr.retired = nil
+
 	pmconf, err := config.AppConfigInstance.GetPoolModelConfig()
 	if err != nil {
 		zlog.LOG.Error("Manager.GetModelConfig", zap.Error(err))
 		return nil
 	}
 
-	update := false
-	mconf := pmconf.ModelConfig
 	pconf := pmconf.PoolConfig
-	if mgr.curCfg.ModelConfig.Version != mconf.Version || mgr.curCfg.PoolConfig.Version != pconf.Version {
-		update = true
+	mconfs := map[string]config.ModelConfig{DefaultModelId: pmconf.ModelConfig}
+	for id, mconf := range pmconf.Models {
+		if id != DefaultModelId {
+			mconfs[id] = mconf
+		}
 	}
+	// a new pool reloads every model not yet loaded over it, otherwise
+	// only the new versions
+	updates := make(map[string]config.ModelConfig)
+	for id, mconf := range mconfs {
+		cur, ok := mgr.curCfgs[id]
+		if !ok || mgr.curPoolVersions[id] != pconf.Version || cur.Version != mconf.Version {
+			updates[id] = mconf
+		}
+	}
+
+	sconf := pmconf.Shadow
+	if s := mgr.getShadow(); s != nil {
+		s.setConf(&sconf)
+	}
+	shadowUpdate := sconf.Sample > 0 && len(sconf.Model.Path) > 0 &&
+		(mgr.curShadowPool != pconf.Version || mgr.curShadow.Version != sconf.Model.Version)
 
-	if !update {
+	removals := false
+	for id := range mgr.getHandles() {
+		if _, ok := mconfs[id]; !ok {
+			removals = true
+		}
+	}
+
+	if len(updates) == 0 && !shadowUpdate && !removals {
 		return nil
 	}
 	job := func() {
-		poolPath := getPath(envCfg.WorkDir, "pool", pconf.Path)
-		err := mgr.downloadFile(envCfg, pconf.Path, poolPath)
-		if err != nil {
-			return
+		// every file downloads at once, the loads wait for them all
+		var wg sync.WaitGroup
+		poolDir := "pool"
+		if pconf.LazyRows > 0 {
+			poolDir = filepath.Join("pool", pconf.Version)
 		}
-		modelPath := getPath(envCfg.WorkDir, "model", mconf.Path)
-		err = mgr.downloadFile(envCfg, mconf.Path, modelPath)
-		if err != nil {
-			return
+		poolPath := getPath(envCfg.WorkDir, poolDir, pconf.Path)
+		poolDigest := mgr.curPoolDigest
+		var poolErr error
+		poolFetch := mgr.curPool.Version != pconf.Version
+		if _, err := os.Stat(poolPath); err != nil {
+			// e.g. the first load since the pool became lazy
+			poolFetch = true
+		}
+		if poolFetch {
+			wg.Add(1)
+			go func() {
+				defer wg.Done()
+				poolErr = mgr.downloadFile(envCfg, pconf.Path, poolPath)
+				if poolErr != nil {
+					return
+				}
+				poolDigest, poolErr = fileDigest(poolPath)
+				if poolErr != nil {
+					zlog.LOG.Error("Manager.loadAllJob pool digest", zap.Error(poolErr))
+				}
+			}()
+		}
+		files := make(map[string]*modelFiles, len(updates))
+		for id, mconf := range updates {
+			id, mconf, f := id, mconf, &modelFiles{}
+			files[id] = f
+			wg.Add(1)
+			go func() {
+				defer wg.Done()
+				*f = mgr.downloadModelFiles(envCfg, modelDir(id), &mconf)
+			}()
+		}
+		var shadowFiles modelFiles
+		if shadowUpdate {
+			wg.Add(1)
+			go func() {
+				defer wg.Done()
+				shadowFiles = mgr.downloadModelFiles(envCfg, "shadow", &sconf.Model)
+			}()
 		}
-		lubanPath := getPath(envCfg.WorkDir, "model", mconf.Kit)
-		err = mgr.downloadFile(envCfg, mconf.Kit, lubanPath)
-		if err != nil {
+		wg.Wait()
+		if poolErr != nil {
 			return
 		}
-		old := mgr.getInfer()
-		ins := wrapper.NewWrapper(poolPath, pconf.Key, lubanPath, modelPath)
-		if ins != nil {
-			atomic.StorePointer((*unsafe.Pointer)(unsafe.Pointer(&mgr.ins)), unsafe.Pointer(ins))
-			mgr.curCfg = *pmconf
-			old.Close()
+		if poolFetch {
+			mgr.curPool = pconf
+			mgr.curPoolDigest = poolDigest
+		}
+		if len(pconf.CacheDir) > 0 {
+			os.MkdirAll(pconf.CacheDir, os.ModePerm)
+			defer prunePoolCache(pconf.CacheDir)
 		}
 
+		// models over the same pool file and an identical toolkit share
+		// the processed pool in the library, so they load one by one
+		handles := make(map[string]*wrapper.Handle)
+		for id, handle := range mgr.getHandles() {
+			handles[id] = handle
+		}
+		for id, mconf := range updates {
+			f := files[id]
+			if f.err != nil {
+				continue
+			}
+			digest, err := fileDigest(f.modelPath, f.lubanPath)
+			if err != nil {
+				zlog.LOG.Error("Manager.loadAllJob model digest", zap.Error(err))
+				continue
+			}
+			digest = poolDigest + digest + loadDigest(&pconf, &mconf)
+			handle, ok := handles[id]
+			if ok && mgr.curDigests[id] == digest {
+				mgr.curCfgs[id] = mconf
+				mgr.curPoolVersions[id] = pconf.Version
+				zlog.LOG.Info("Manager.loadAllJob unchanged contents, reload skipped",
+					zap.String("modelId", id), zap.String("version", mconf.Version))
+				continue
+			}
+			ins := wrapper.NewWrapper(poolPath, poolHash(poolDigest), f.lubanPath, f.modelPath, &pconf, &mconf)
+			if ins == nil {
+				continue
+			}
+			if !ok {
+				handle = wrapper.NewHandle()
+				handles[id] = handle
+			}
+			handle.Publish(ins)
+			mgr.curCfgs[id] = mconf
+			mgr.curPoolVersions[id] = pconf.Version
+			mgr.curDigests[id] = digest
+			zlog.LOG.Info("Manager.loadAllJob", zap.String("modelId", id),
+				zap.String("version", mconf.Version))
+		}
+		// models dropped from the config stop resolving first, then their
+		// last version is freed once the requests in flight are done
+		var removed []*wrapper.Handle
+		for id, handle := range handles {
+			if _, ok := mconfs[id]; !ok {
+				removed = append(removed, handle)
+				delete(handles, id)
+				delete(mgr.curCfgs, id)
+				delete(mgr.curPoolVersions, id)
+				delete(mgr.curDigests, id)
+				zlog.LOG.Info("Manager.loadAllJob removed", zap.String("modelId", id))
+			}
+		}
+		atomic.StorePointer(&mgr.handles, unsafe.Pointer(&handles))
+		for _, handle := range removed {
+			handle.Unpublish()
+		}
+		mgr.retired = append(mgr.retired, removed...)
+		if shadowUpdate && shadowFiles.err == nil {
+			mgr.loadShadow(poolPath, poolDigest, &shadowFiles, &pconf, &sconf)
+		}
+		// one index per model and the shadow
+		pruneIndexes(poolPath, len(mconfs)+1)
+		if pconf.LazyRows > 0 {
+			prunePoolVersions(filepath.Join(envCfg.WorkDir, "pool"), pconf.Version)
+		}
 	}
 	return job
 }
 
-func (mgr *Manager) Rank(userFeatureJson string, itemIds []string) ([]float32, error) {
-	stat := prome.NewStat("Manager.Rank")
-	defer stat.End()
-	infer := mgr.getInfer()
-	return infer.Rank(userFeatureJson, itemIds), nil
+func (mgr *Manager) loadShadow(poolPath, poolDigest string, files *modelFiles, pconf *config.PoolConfig, sconf *config.ShadowConfig) {
+	mconf := sconf.Model
+	digest, err := fileDigest(files.modelPath, files.lubanPath)
+	if err != nil {
+		zlog.LOG.Error("Manager.loadShadow digest", zap.Error(err))
+		return
+	}
+	digest = poolDigest + digest + loadDigest(pconf, &mconf)
+	if mgr.getShadow() != nil && mgr.curShadowDigest == digest {
+		mgr.curShadow = mconf
+		mgr.curShadowPool = pconf.Version
+		return
+	}
+	ins := wrapper.NewWrapper(poolPath, poolHash(poolDigest), files.lubanPath, files.modelPath, pconf, &mconf)
+	if ins == nil {
+		return
+	}
+	s := mgr.getShadow()
+	if s == nil {
+		// offered requests only once it has a model
+		s = newShadow(sconf)
+		s.handle.Publish(ins)
+		atomic.StorePointer(&mgr.shadow, unsafe.Pointer(s))
+	} else {
+		s.handle.Publish(ins)
+	}
+	mgr.curShadow = mconf
+	mgr.curShadowPool = pconf.Version
+	mgr.curShadowDigest = digest
+	zlog.LOG.Info("Manager.loadShadow", zap.String("version", mconf.Version))
+}
+
+// NewUserContext processes the user features once for all the Rank calls
+// of one request, binary features are used when given.
+// The caller must Close the context.
+func NewUserContext(handle *wrapper.Handle, userFeatureJson string, userFeatures []byte) (*wrapper.UserContext, error) {
+	var ctx *wrapper.UserContext
+	if len(userFeatures) > 0 {
+		ctx = handle.NewUserContextBin(userFeatures)
+	} else if len(userFeatureJson) > 0 {
+		ctx = handle.NewUserContext(userFeatureJson)
+	}
+	if ctx == nil {
+		return nil, errors.New("invalid user features")
+	}
+	return ctx, nil
 }
 
 var MgrIns Manager
@@ -0,0 +1,69 @@
+package mgr
+
+import (
+	"os"
+	"path/filepath"
+	"time"
+
+	"github.com/uopensail/ulib/prome"
+	"github.com/uopensail/ulib/zlog"
+	"go.uber.org/zap"
+)
+
+const (
+	poolReportInterval = time.Minute
+	// hottest items logged by each pool report
+	poolReportHot = 20
+)
+
+// reportPools records how many items the lazy pools have processed, and
+// logs the items read the most
+func (mgr *Manager) reportPools() {
+	ticker := time.NewTicker(poolReportInterval)
+	defer ticker.Stop()
+	for range ticker.C {
+		for id, handle := range mgr.getHandles() {
+			stats := handle.PoolStats()
+			if stats.Capacity == 0 {
+				continue
+			}
+			name := id
+			if id == DefaultModelId {
+				name = "default"
+			}
+			stat := prome.NewStat("Pool.Processed." + name)
+			stat.SetCounter(int(stats.Processed))
+			stat.End()
+			zlog.LOG.Info("Pool.Report", zap.String("modelId", name),
+				zap.Int64("processed", stats.Processed),
+				zap.Int64("capacity", stats.Capacity),
+				zap.Int64("hits", stats.Hits),
+				zap.Int64("misses", stats.Misses),
+				zap.String("hot", handle.PoolHot(poolReportHot)))
+		}
+	}
+}
+
+// prunePoolVersions removes the pool files of the other versions. A lazy
+// pool maps its file, so every version is downloaded apart rather than over
+// the served one. The mappings of the pools still served keep their removed
+// files readable.
+func prunePoolVersions(dir, version string) {
+	entries, err := os.ReadDir(dir)
+	if err != nil {
+		return
+	}
+	for _, entry := range entries {
+		if entry.IsDir() && entry.Name() != version {
+			os.RemoveAll(filepath.Join(dir, entry.Name()))
+		}
+	}
+}
+
+// pruneIndexes removes the hnsw indexes next to the pool file that no model
+// built or loaded lately, keep is how many models may have one. the library
+// names them by the item tower they index and touches the ones it loads
+func pruneIndexes(poolPath string, keep int) {
+	removeStaleTemps(poolPath + ".*.hnsw.*.tmp")
+	keepNewest(poolPath+".*.hnsw", ".hnsw", keep)
+}
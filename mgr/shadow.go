@@ -0,0 +1,254 @@
+package mgr
+
+import (
+	"math"
+	"math/rand"
+	"sort"
+	"sync"
+	"sync/atomic"
+	"time"
+	"unsafe"
+
+	"github.com/uopensail/longmen/config"
+	"github.com/uopensail/longmen/wrapper"
+	"github.com/uopensail/ulib/prome"
+	"github.com/uopensail/ulib/zlog"
+	"go.uber.org/zap"
+)
+
+const (
+	shadowReportInterval = time.Minute
+	// scores and latencies kept per report for the quantiles
+	shadowSampleCap = 100000
+)
+
+// MirrorRequest is a ranked request offered to the shadow model
+type MirrorRequest struct {
+	ModelId         string
+	UserFeatureJson string
+	UserFeatures    []byte
+	Filter          string
+	ItemIds         []string
+	U64Ids          []uint64
+	Scores          []float32
+	Latency         time.Duration
+}
+
+type shadowTask struct {
+	*MirrorRequest
+	rows *wrapper.UserRows
+}
+
+// shadow scores a sample of the live requests with a candidate model on
+// its own goroutines. The requests are handed over through a bounded queue
+// and dropped when it is full, so the mirrored path never waits for it.
+// The queue and the workers are sized once, on the first load.
+type shadow struct {
+	handle *wrapper.Handle
+	conf   unsafe.Pointer // *config.ShadowConfig
+	tasks  chan *shadowTask
+
+	mu      sync.Mutex
+	summary shadowSummary
+}
+
+// sources of the request sampling, the global one of math/rand takes a
+// lock on every request
+var (
+	sampleSeed  int64
+	sampleRands = sync.Pool{
+		New: func() interface{} {
+			seed := time.Now().UnixNano() + atomic.AddInt64(&sampleSeed, 1)
+			return rand.New(rand.NewSource(seed))
+		},
+	}
+)
+
+// sampled reports whether a request is picked with probability rate
+func sampled(rate float64) bool {
+	if rate <= 0 {
+		return false
+	}
+	if rate >= 1 {
+		return true
+	}
+	r := sampleRands.Get().(*rand.Rand)
+	ok := r.Float64() < rate
+	sampleRands.Put(r)
+	return ok
+}
+
+func newShadow(conf *config.ShadowConfig) *shadow {
+	queue, workers := conf.Queue, conf.Workers
+	if queue <= 0 {
+		queue = 1024
+	}
+	if workers <= 0 {
+		workers = 1
+	}
+	s := &shadow{
+		handle: wrapper.NewHandle(),
+		tasks:  make(chan *shadowTask, queue),
+	}
+	s.setConf(conf)
+	for i := 0; i < workers; i++ {
+		go s.run()
+	}
+	go s.report()
+	return s
+}
+
+func (s *shadow) setConf(conf *config.ShadowConfig) {
+	c := *conf
+	atomic.StorePointer(&s.conf, unsafe.Pointer(&c))
+}
+
+func (s *shadow) getConf() *config.ShadowConfig {
+	return (*config.ShadowConfig)(atomic.LoadPointer(&s.conf))
+}
+
+// offer queues the request if it is sampled, ctx stays owned by the caller
+func (s *shadow) offer(ctx *wrapper.UserContext, request *MirrorRequest) {
+	conf := s.getConf()
+	if conf.ModelId != request.ModelId || !sampled(conf.Sample) {
+		return
+	}
+	task := &shadowTask{MirrorRequest: request, rows: ctx.Rows()}
+	select {
+	case s.tasks <- task:
+	default:
+		task.rows.Close()
+		stat := prome.NewStat("Shadow.Dropped")
+		stat.MarkErr()
+		stat.End()
+	}
+}
+
+func (s *shadow) run() {
+	for task := range s.tasks {
+		s.score(task)
+	}
+}
+
+// report logs the summary every shadowReportInterval, also once the
+// requests stop coming, and starts a new one
+func (s *shadow) report() {
+	ticker := time.NewTicker(shadowReportInterval)
+	defer ticker.Stop()
+	for range ticker.C {
+		s.mu.Lock()
+		summary := s.summary
+		s.summary = shadowSummary{}
+		s.mu.Unlock()
+		summary.report(s.getConf().Model.Version)
+	}
+}
+
+func (s *shadow) score(task *shadowTask) {
+	defer task.rows.Close()
+	stat := prome.NewStat("Shadow.Rank")
+	defer stat.End()
+
+	start := time.Now()
+	// the user features processed for the primary model are reused when
+	// the toolkits match, the item rows come from the shared pool
+	ctx := s.handle.NewUserContextFromRows(task.rows)
+	if ctx == nil && len(task.UserFeatures) > 0 {
+		ctx = s.handle.NewUserContextBin(task.UserFeatures)
+	} else if ctx == nil && len(task.UserFeatureJson) > 0 {
+		ctx = s.handle.NewUserContext(task.UserFeatureJson)
+	}
+	if ctx == nil {
+		stat.MarkErr()
+		return
+	}
+	defer ctx.Close()
+	if err := ctx.SetFilter(task.Filter); err != nil {
+		stat.MarkErr()
+		return
+	}
+	var scores []float32
+	if task.U64Ids != nil {
+		scores = ctx.RankU64(task.U64Ids)
+	} else {
+		scores = ctx.Rank(task.ItemIds)
+	}
+	latency := time.Since(start)
+	stat.SetCounter(len(scores))
+
+	s.mu.Lock()
+	s.summary.add(task.Scores, scores, task.Latency, latency)
+	s.mu.Unlock()
+}
+
+// shadowSummary compares the two models over the requests of one report
+type shadowSummary struct {
+	requests         int
+	pairs            int
+	deltaSum         float64
+	deltaMax         float64
+	primaryScores    []float64
+	shadowScores     []float64
+	primaryLatencies []float64
+	shadowLatencies  []float64
+}
+
+func (sum *shadowSummary) add(primary, shadow []float32, primaryLatency, shadowLatency time.Duration) {
+	sum.requests++
+	sum.primaryLatencies = appendSample(sum.primaryLatencies, primaryLatency.Seconds()*1000)
+	sum.shadowLatencies = appendSample(sum.shadowLatencies, shadowLatency.Seconds()*1000)
+	for i := 0; i < len(primary) && i < len(shadow); i++ {
+		if !validScore(primary[i]) || !validScore(shadow[i]) {
+			continue
+		}
+		delta := math.Abs(float64(shadow[i]) - float64(primary[i]))
+		sum.pairs++
+		sum.deltaSum += delta
+		sum.deltaMax = math.Max(sum.deltaMax, delta)
+		sum.primaryScores = appendSample(sum.primaryScores, float64(primary[i]))
+		sum.shadowScores = appendSample(sum.shadowScores, float64(shadow[i]))
+	}
+}
+
+func (sum *shadowSummary) report(version string) {
+	if sum.requests == 0 {
+		return
+	}
+	meanDelta := 0.0
+	if sum.pairs > 0 {
+		meanDelta = sum.deltaSum / float64(sum.pairs)
+	}
+	zlog.LOG.Info("Shadow.Report",
+		zap.String("version", version),
+		zap.Int("requests", sum.requests),
+		zap.Int("scores", sum.pairs),
+		zap.Float64("meanAbsDelta", meanDelta),
+		zap.Float64("maxAbsDelta", sum.deltaMax),
+		zap.Float64s("primaryScoreP50P90P99", quantiles(sum.primaryScores)),
+		zap.Float64s("shadowScoreP50P90P99", quantiles(sum.shadowScores)),
+		zap.Float64s("primaryLatencyMsP50P90P99", quantiles(sum.primaryLatencies)),
+		zap.Float64s("shadowLatencyMsP50P90P99", quantiles(sum.shadowLatencies)))
+}
+
+func validScore(score float32) bool {
+	return score != wrapper.MissingScore && score != wrapper.FilteredScore
+}
+
+func appendSample(samples []float64, value float64) []float64 {
+	if len(samples) >= shadowSampleCap {
+		return samples
+	}
+	return append(samples, value)
+}
+
+func quantiles(values []float64) []float64 {
+	if len(values) == 0 {
+		return nil
+	}
+	sort.Float64s(values)
+	result := make([]float64, 0, 3)
+	for _, q := range []float64{0.5, 0.9, 0.99} {
+		result = append(result, values[int(q*float64(len(values)-1))])
+	}
+	return result
+}
@@ -3,9 +3,12 @@ package services
 import (
 	"context"
 	"errors"
+	"strconv"
+	"time"
 
 	"github.com/uopensail/longmen/api"
 	"github.com/uopensail/longmen/mgr"
+	"github.com/uopensail/longmen/wrapper"
 
 	"github.com/gin-gonic/gin"
 	"github.com/go-kratos/kratos/v2/registry"
@@ -46,6 +49,7 @@ func (srv *Services) RegisterGinRouter(ginEngine *gin.Engine) {
 	apiV1 := ginEngine.Group("api/v1")
 	{
 		apiV1.POST("/rank", srv.RankHandler)
+		apiV1.POST("/retrieve", srv.RetrieveHandler)
 	}
 
 }
@@ -69,25 +73,157 @@ func (srv *Services) RankHandler(c *gin.Context) {
 	return
 }
 
+// modelName labels the metrics of each served model
+func modelName(modelId string) string {
+	if modelId == mgr.DefaultModelId {
+		return "default"
+	}
+	return modelId
+}
+
+// unknownModel counts the requests for model ids that are not served under
+// one name, so clients can not create a metric per id they send
+func unknownModel(method string, err error) error {
+	stat := prome.NewStat("Services." + method + ".unknown")
+	stat.MarkErr()
+	stat.End()
+	return err
+}
+
 func (srv *Services) Rank(ctx context.Context, request *api.Request) (*api.Response, error) {
+	handle, err := mgr.MgrIns.GetHandle(request.ModelId)
+	if err != nil {
+		return nil, unknownModel("Rank", err)
+	}
+	stat := prome.NewStat("Services.Rank." + modelName(request.ModelId))
+	defer stat.End()
 	if len(request.Records) <= 0 {
+		stat.MarkErr()
 		return nil, errors.New("input empty")
 	}
-	itemIds := make([]string, len(request.Records))
-	for i := 0; i < len(request.Records); i++ {
-		itemIds[i] = request.Records[i].Id
+	scores, err := srv.rank(handle, request)
+	if err != nil {
+		stat.MarkErr()
+		return nil, err
 	}
-	scores, err := mgr.MgrIns.Rank(request.UserFeatures, itemIds)
+	stat.SetCounter(len(request.Records))
 	resp := &api.Response{
 		UserId:  request.UserId,
-		Records: request.Records,
+		Records: make([]*api.Record, 0, len(request.Records)),
 	}
 	for i := 0; i < len(request.Records); i++ {
-		resp.Records[i].Score = scores[i]
+		if scores[i] == wrapper.FilteredScore {
+			continue
+		}
+		request.Records[i].Score = scores[i]
+		resp.Records = append(resp.Records, request.Records[i])
 	}
 	return resp, err
 }
 
+func (srv *Services) RetrieveHandler(c *gin.Context) {
+	stat := prome.NewStat("App.RetrieveHandler")
+	defer stat.End()
+
+	request := &api.Request{}
+	if err := c.Bind(request); err != nil {
+		zlog.LOG.Error("request bind error: ", zap.Error(err))
+		return
+	}
+	resp, err := srv.Retrieve(context.Background(), request)
+	if err != nil {
+		zlog.LOG.Error("retrieve error: ", zap.Error(err))
+		c.JSON(404, err.Error())
+		return
+	}
+	c.JSON(200, resp)
+	return
+}
+
+// Retrieve scores the whole pool for the user and returns the top
+// request.TopK items, records in the request are ignored
+func (srv *Services) Retrieve(ctx context.Context, request *api.Request) (*api.Response, error) {
+	handle, err := mgr.MgrIns.GetHandle(request.ModelId)
+	if err != nil {
+		return nil, unknownModel("Retrieve", err)
+	}
+	stat := prome.NewStat("Services.Retrieve." + modelName(request.ModelId))
+	defer stat.End()
+	if request.TopK <= 0 {
+		stat.MarkErr()
+		return nil, errors.New("topK must be positive")
+	}
+	userCtx, err := mgr.NewUserContext(handle, request.UserFeatures, request.UserFeaturesBin)
+	if err != nil {
+		stat.MarkErr()
+		return nil, err
+	}
+	defer userCtx.Close()
+	if err = userCtx.SetFilter(request.Filter); err != nil {
+		stat.MarkErr()
+		return nil, err
+	}
+
+	topK := int(request.TopK)
+	if limit := config.AppConfigInstance.TopKLimit(); topK > limit {
+		topK = limit
+	}
+	itemIds, scores := userCtx.Retrieve(topK)
+	resp := &api.Response{
+		UserId:  request.UserId,
+		Records: make([]*api.Record, len(itemIds)),
+	}
+	for i := 0; i < len(itemIds); i++ {
+		resp.Records[i] = &api.Record{Id: itemIds[i], Score: scores[i]}
+	}
+	return resp, nil
+}
+
+func (srv *Services) rank(handle *wrapper.Handle, request *api.Request) ([]float32, error) {
+	start := time.Now()
+	ctx, err := mgr.NewUserContext(handle, request.UserFeatures, request.UserFeaturesBin)
+	if err != nil {
+		return nil, err
+	}
+	defer ctx.Close()
+	if err = ctx.SetFilter(request.Filter); err != nil {
+		return nil, err
+	}
+
+	mirror := &mgr.MirrorRequest{
+		ModelId:         request.ModelId,
+		UserFeatureJson: request.UserFeatures,
+		UserFeatures:    request.UserFeaturesBin,
+		Filter:          request.Filter,
+	}
+	if ctx.U64Key() {
+		ids := make([]uint64, len(request.Records))
+		ok := true
+		for i := 0; i < len(request.Records); i++ {
+			id, err := strconv.ParseUint(request.Records[i].Id, 10, 64)
+			if err != nil {
+				ok = false
+				break
+			}
+			ids[i] = id
+		}
+		if ok {
+			scores := ctx.RankU64(ids)
+			mirror.U64Ids, mirror.Scores, mirror.Latency = ids, scores, time.Since(start)
+			mgr.MgrIns.Mirror(ctx, mirror)
+			return scores, nil
+		}
+	}
+	itemIds := make([]string, len(request.Records))
+	for i := 0; i < len(request.Records); i++ {
+		itemIds[i] = request.Records[i].Id
+	}
+	scores := ctx.Rank(itemIds)
+	mirror.ItemIds, mirror.Scores, mirror.Latency = itemIds, scores, time.Since(start)
+	mgr.MgrIns.Mirror(ctx, mirror)
+	return scores, nil
+}
+
 func (srv *Services) Check(context.Context, *grpc_health_v1.HealthCheckRequest) (*grpc_health_v1.HealthCheckResponse, error) {
 	return &grpc_health_v1.HealthCheckResponse{Status: grpc_health_v1.HealthCheckResponse_SERVING}, nil
 }
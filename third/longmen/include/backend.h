@@ -0,0 +1,86 @@
+//
+// `LongMen` - 'Torch Model inference in c++'
+// Copyright (C) 2019 - present timepi <timepi123@gmail.com>
+// LongMen is provided under: GNU Affero General Public License (AGPL3.0)
+// https://www.gnu.org/licenses/agpl-3.0.html unless stated otherwise.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU Affero General Public License for more details.
+//
+//
+
+#ifndef LONGMAN_BACKEND_H
+#define LONGMAN_BACKEND_H
+
+#pragma once
+
+#include "longmen.h"
+#include <string>
+#include <torch/script.h>
+
+// Rows of a model input. The storage is cache line aligned and recycled
+// between calls and not zeroed, so every row must be set before use.
+class Tensor {
+public:
+  Tensor() = delete;
+  // huge_page is the LONGMEN_HUGEPAGE_* policy of the large buffers
+  Tensor(int64_t rows, int64_t cols, int64_t stride, torch::Dtype type,
+         int huge_page = LONGMEN_HUGEPAGE_OFF);
+  ~Tensor();
+  void set_row(int64_t row, char *data);
+  char *row(int64_t row) { return m_data + m_cols * m_stride * row; }
+  void print();
+
+public:
+  int64_t m_rows;
+  int64_t m_cols;
+  int64_t m_stride;
+  torch::Dtype m_type;
+  int m_huge_page;
+  char *m_data;
+};
+
+class Input {
+public:
+  Input() = delete;
+  Input(int size);
+  ~Input();
+  Tensor *&operator[](int index);
+  void print();
+
+public:
+  int m_size;
+  Tensor **m_tensors;
+};
+
+// Inference runtime behind Model. The inputs are the toolkit groups in
+// group id order, or the user or item placer groups for the towers, and
+// the output is one float32 score per row.
+class Backend {
+public:
+  Backend() : m_two_tower(false), m_has_head(false) {}
+  Backend(const Backend &) = delete;
+  Backend(const Backend &&) = delete;
+  virtual ~Backend() = default;
+
+  virtual void forward(Input &inputs, float *result) = 0;
+  // two tower methods, only called when `m_two_tower` and `m_has_head` say
+  // the model has them
+  virtual torch::Tensor user_tower(Input &inputs) { return {}; }
+  virtual torch::Tensor item_tower(Input &inputs) { return {}; }
+  virtual void head(torch::Tensor user, torch::Tensor item, float *result) {}
+  // human readable inputs and outputs of the model
+  virtual std::string describe() = 0;
+
+public:
+  bool m_two_tower;
+  bool m_has_head;
+};
+
+#endif // LONGMAN_BACKEND_H
@@ -0,0 +1,48 @@
+//
+// `LongMen` - 'Torch Model inference in c++'
+// Copyright (C) 2019 - present timepi <timepi123@gmail.com>
+// LongMen is provided under: GNU Affero General Public License (AGPL3.0)
+// https://www.gnu.org/licenses/agpl-3.0.html unless stated otherwise.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU Affero General Public License for more details.
+//
+//
+
+#ifndef LONGMAN_CODEC_H
+#define LONGMAN_CODEC_H
+
+#pragma once
+
+#include "toolkit.h"
+
+// Binary user features, all integers are little-endian:
+//
+//   u32 count
+//   count x {
+//     u8  type        luban::DataType, 0:int64 1:float32 2:string
+//                     3:int64 list 4:float32 list 5:string list
+//     u16 name length, name bytes
+//     value           int64: i64, float32: f32, string: u32 length + bytes,
+//                     lists: u32 n + n values encoded as above
+//   }
+//
+// There is no text parsing, but every value is still copied out of the
+// buffer into its luban feature. Returns nullptr if the buffer is malformed.
+luban::SharedFeaturesPtr decode_features(const char *data, size_t len);
+
+// JSON user features, `{"name": {"type": 0, "value": 1}, ...}`.
+// Built with `LONGMEN_USE_SIMDJSON` the text is parsed by a simdjson
+// on-demand parser kept per thread, otherwise it is handed to luban.
+// simdjson reads past the end of the text, so it is first copied into a
+// padded buffer of the thread, the callers do not own padding to lend it.
+// Returns nullptr if the text can not be parsed.
+luban::SharedFeaturesPtr parse_features(const char *data, size_t len);
+
+#endif // LONGMAN_CODEC_H
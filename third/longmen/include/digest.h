@@ -0,0 +1,38 @@
+//
+// `LongMen` - 'Torch Model inference in c++'
+// Copyright (C) 2019 - present timepi <timepi123@gmail.com>
+// LongMen is provided under: GNU Affero General Public License (AGPL3.0)
+// https://www.gnu.org/licenses/agpl-3.0.html unless stated otherwise.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU Affero General Public License for more details.
+//
+//
+
+#ifndef LONGMAN_DIGEST_H
+#define LONGMAN_DIGEST_H
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <string_view>
+
+// 64 bit content hash, not cryptographic: files of the same content, like
+// the pool and toolkit of different versions, are told apart by it
+uint64_t hash_bytes(const void *data, size_t len, uint64_t seed);
+// hash of the whole file read in chunks, 0 if it cannot be read
+uint64_t hash_file(std::string_view path);
+
+// name next to path for a file written aside and renamed over it, unique
+// to the process and thread, so writers of the same path never share one
+std::string temp_path(std::string_view path);
+
+#endif // LONGMAN_DIGEST_H
@@ -0,0 +1,89 @@
+//
+// `LongMen` - 'Torch Model inference in c++'
+// Copyright (C) 2019 - present timepi <timepi123@gmail.com>
+// LongMen is provided under: GNU Affero General Public License (AGPL3.0)
+// https://www.gnu.org/licenses/agpl-3.0.html unless stated otherwise.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU Affero General Public License for more details.
+//
+//
+
+#ifndef LONGMAN_FILTER_H
+#define LONGMAN_FILTER_H
+
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+typedef unsigned char BitMap;
+
+BitMap *new_bitmap(int size);
+void free_bitmap(BitMap *data);
+void set_bitmap(BitMap *bitMap, int index);
+int check_bitmap(BitMap *bitMap, int index);
+
+// Pool rows holding one attribute value. Like a roaring container, a set
+// stays a sorted row array while it is sparse and turns into a bitmap over
+// all the pool rows once that is smaller.
+class RowSet {
+public:
+  RowSet() : m_bitmap(nullptr) {}
+  RowSet(const RowSet &) = delete;
+  RowSet(RowSet &&other) noexcept;
+  ~RowSet();
+
+  // rows are added in increasing order while the pool loads
+  void add(int64_t row);
+  void seal(int64_t size);
+  bool contains(int64_t row) const;
+  // rows of the set in increasing order, size is the one it was sealed with
+  std::vector<uint32_t> rows(int64_t size) const;
+
+private:
+  std::vector<uint32_t> m_rows;
+  BitMap *m_bitmap;
+};
+
+// attribute name -> attribute value -> rows
+using Attributes =
+    std::unordered_map<std::string, std::unordered_map<std::string, RowSet>>;
+
+// Candidate filter over the pool attributes, compiled from an expression
+// like `region=cn|us&stock!=0`: clauses are and-ed, the values of a clause
+// are or-ed and `!=` excludes the listed values.
+class Filter {
+public:
+  Filter() = delete;
+  Filter(const Filter &) = delete;
+  Filter(const Filter &&) = delete;
+  Filter(const Attributes &attributes, std::string_view expr);
+  ~Filter() = default;
+
+  bool check(int64_t row) const;
+
+private:
+  struct Clause {
+    std::vector<const RowSet *> values;
+    bool negate;
+  };
+
+public:
+  // false if the expression is malformed or names an unknown attribute
+  bool m_valid;
+
+private:
+  std::vector<Clause> m_clauses;
+};
+
+#endif // LONGMAN_FILTER_H
@@ -0,0 +1,90 @@
+//
+// `LongMen` - 'Torch Model inference in c++'
+// Copyright (C) 2019 - present timepi <timepi123@gmail.com>
+// LongMen is provided under: GNU Affero General Public License (AGPL3.0)
+// https://www.gnu.org/licenses/agpl-3.0.html unless stated otherwise.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU Affero General Public License for more details.
+//
+//
+
+#ifndef LONGMAN_HNSW_H
+#define LONGMAN_HNSW_H
+
+#pragma once
+
+#include "pool.h"
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <vector>
+
+// HNSW graph over the item tower rows of a pool, searched by inner product.
+// Nodes are pool rows, the level 0 links are kept in one flat array.
+class HNSW {
+public:
+  HNSW() = delete;
+  HNSW(const HNSW &) = delete;
+  HNSW(const HNSW &&) = delete;
+  // build the graph, inserting the rows in parallel
+  HNSW(const Pool &pool, int m, int ef_construction);
+  ~HNSW() = default;
+
+  // hash of all the item tower rows of the pool, the index is only valid
+  // for the embeddings it was built from, so it goes into the file name
+  static uint64_t fingerprint(const Pool &pool);
+  // nullptr if the file is missing or was built from other embeddings
+  static std::shared_ptr<HNSW> load(std::string_view path, const Pool &pool,
+                                    uint64_t fingerprint);
+  bool save(std::string_view path, uint64_t fingerprint) const;
+
+  // approximate top k rows by inner product with the query, which is padded
+  // to `m_tower_stride` floats. results are in descending order of score
+  void search(const float *query, int k, int ef,
+              std::vector<std::pair<float, int64_t>> &result) const;
+
+private:
+  // (distance, node), distance is the negative inner product
+  using Candidate = std::pair<float, uint32_t>;
+
+  explicit HNSW(const Pool &pool);
+  float distance(const float *query, uint32_t node) const;
+  uint32_t *links(uint32_t node, int level);
+  const uint32_t *links(uint32_t node, int level) const;
+  void neighbors(uint32_t node, int level, bool lock,
+                 std::vector<uint32_t> &result) const;
+  uint32_t greedy(const float *query, uint32_t entry, int from, int to,
+                  bool lock) const;
+  std::vector<Candidate> search_layer(const float *query, uint32_t entry,
+                                      int ef, int level, bool lock) const;
+  void select(std::vector<Candidate> &candidates, int m) const;
+  void connect(uint32_t node, std::vector<Candidate> &candidates, int level);
+  void insert(uint32_t node);
+  std::mutex &lock(uint32_t node) const;
+
+public:
+  int64_t m_size;
+
+private:
+  const Pool &m_pool;
+  int m_m;
+  int m_m0;
+  int m_ef_construction;
+  int m_max_level;
+  uint32_t m_entry;
+  std::vector<int> m_levels;
+  // node links are stored as [count, id, id, ...]
+  std::vector<uint32_t> m_links0;
+  std::vector<std::vector<uint32_t>> m_links;
+  std::mutex m_global;
+  mutable std::vector<std::mutex> m_locks;
+};
+
+#endif // LONGMAN_HNSW_H
@@ -0,0 +1,41 @@
+//
+// `LongMen` - 'Torch Model inference in c++'
+// Copyright (C) 2019 - present timepi <timepi123@gmail.com>
+// LongMen is provided under: GNU Affero General Public License (AGPL3.0)
+// https://www.gnu.org/licenses/agpl-3.0.html unless stated otherwise.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU Affero General Public License for more details.
+//
+//
+
+#ifndef LONGMAN_HUGEPAGE_H
+#define LONGMAN_HUGEPAGE_H
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// size of the huge pages the allocations are rounded to
+#define HUGEPAGE_SIZE (2UL << 20)
+
+// Page allocations for the large, randomly accessed buffers: the pool rows,
+// the item tower matrix and the big input workspaces. Depending on the
+// policy of the caller, see LONGMEN_HUGEPAGE_*, the mapping is backed by
+// reserved huge pages or advised for transparent huge pages, and falls back
+// to normal pages when that fails. The memory is zeroed and page aligned.
+void *page_alloc(size_t bytes, int policy);
+void page_free(void *ptr);
+
+// bytes allocated by page_alloc, and the part of them the kernel reports as
+// huge page backed in /proc/self/smaps
+void hugepage_stats(int64_t *allocated, int64_t *backed);
+
+#endif // LONGMAN_HUGEPAGE_H
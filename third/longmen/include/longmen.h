@@ -17,15 +17,192 @@
 #ifndef LONGMAN_H
 #define LONGMAN_H
 
+#include <float.h>
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+// type of the item keys in the pool
+enum { LONGMEN_KEY_STRING = 0, LONGMEN_KEY_UINT64 = 1 };
+
+// huge page policy for the pool and the input workspaces: off, transparent
+// huge pages by madvise, or reserved huge pages by MAP_HUGETLB falling back
+// to transparent ones
+enum {
+  LONGMEN_HUGEPAGE_OFF = 0,
+  LONGMEN_HUGEPAGE_MADVISE = 1,
+  LONGMEN_HUGEPAGE_HUGETLB = 2
+};
+
+// placement of the pool on multi socket hosts: first touch, pages
+// interleaved over the nodes, or one replica per node read by the threads
+// running on it
+enum {
+  LONGMEN_NUMA_OFF = 0,
+  LONGMEN_NUMA_INTERLEAVE = 1,
+  LONGMEN_NUMA_REPLICATE = 2
+};
+
+// storage of the float32 item groups in the pool, decoded back to float32
+// while the model input is gathered. int8 keeps one scale per group and row
+enum {
+  LONGMEN_STORE_FP32 = 0,
+  LONGMEN_STORE_FP16 = 1,
+  LONGMEN_STORE_BF16 = 2,
+  LONGMEN_STORE_INT8 = 3
+};
+
+// precision of the model: fp32, bf16, or bf16 when the cpu has bf16
+// instructions (AVX512-BF16 or AMX). bf16 also runs in fp32 on cpus
+// without them, auto is kept for configs that spell out the intent
+enum {
+  LONGMEN_PRECISION_FP32 = 0,
+  LONGMEN_PRECISION_BF16 = 1,
+  LONGMEN_PRECISION_AUTO = 2
+};
+
+// inference runtime, auto picks onnx for `.onnx` model files and
+// torchscript otherwise
+enum {
+  LONGMEN_BACKEND_AUTO = 0,
+  LONGMEN_BACKEND_TORCHSCRIPT = 1,
+  LONGMEN_BACKEND_ONNX = 2
+};
+
+// how threads pick one of the model replicas: by the cpu they run on, or
+// round robin in the order they first call the model
+enum { LONGMEN_REPLICA_CORE = 0, LONGMEN_REPLICA_ROUND_ROBIN = 1 };
+
+typedef struct {
+  int key_type;
+  // hnsw index over the item tower outputs for longmen_retrieve, built when
+  // ann_m > 0 and saved next to the pool file
+  int ann_m;
+  int ann_ef_construction;
+  int ann_ef;
+  // comma separated categorical item attributes indexed for filtering
+  char *attributes;
+  int attributes_len;
+  int huge_page;
+  int numa;
+  int float_store;
+  int precision;
+  int backend;
+  // torchscript module replicas sharing the weights, each with its own
+  // executor state. 0 or 1 shares one module between all threads
+  int replicas;
+  int replica_policy;
+  // directory of the processed pool cache, keyed by the pool and toolkit
+  // contents. no cache when empty
+  char *cache_dir;
+  int cache_dir_len;
+  // processed rows kept by a lazy pool, which maps the pool file, indexes
+  // the raw item features at load and processes each item on its first
+  // lookup. 0 processes the whole pool at load, and lazy pools keep at
+  // least 64 rows
+  int lazy_rows;
+  // content hash of the pool file when the caller already has one, it keys
+  // the shared and cached processed pools. 0 hashes the file at load
+  uint64_t pool_hash;
+} longmen_options_t;
+
+// score of the candidates missing from the pool
+#define LONGMEN_SCORE_MISSING -1.0f
+// score of the candidates excluded by the filter of the user context
+#define LONGMEN_SCORE_FILTERED (-FLT_MAX)
+
 void *longmen_new_model(char *path, int plen, char *key, int klen,
-                        char *toolkit, int tlen, char *model, int mlen);
+                        char *toolkit, int tlen, char *model, int mlen,
+                        longmen_options_t *options);
 void longmen_del_model(void *model);
 void longmen_forward(void *model, char *user_features, int len, void *items,
                      void *lens, int size, float *scores);
+// items holds all the ids back to back, the i-th id is
+// items[offsets[i]:offsets[i+1]], so offsets has size + 1 entries
+void longmen_forward_flat(void *model, char *user_features, int len,
+                          char *items, int32_t *offsets, int size,
+                          float *scores);
+// user_features in the binary format, see codec.h
+void longmen_forward_bin(void *model, char *user_features, int len,
+                         char *items, int32_t *offsets, int size,
+                         float *scores);
+void longmen_forward_u64(void *model, char *user_features, int len,
+                         uint64_t *items, int size, float *scores);
+
+// processed user features reused by several forward calls of one user,
+// the model must outlive the context
+void *longmen_user_ctx_new(void *model, char *user_features, int len);
+void *longmen_user_ctx_new_bin(void *model, char *user_features, int len);
+void longmen_user_ctx_del(void *ctx);
+// processed user features of ctx, valid after ctx is deleted
+void *longmen_user_rows_new(void *ctx);
+void longmen_user_rows_del(void *rows);
+// context reusing rows processed by another model, nullptr if the toolkits
+// of the two models differ
+void *longmen_user_ctx_from_rows(void *model, void *rows);
+// model of the context, LONGMEN_KEY_* of its pool
+void *longmen_user_ctx_model(void *ctx);
+int longmen_key_type(void *model);
+// restrict the candidates of ctx to the pool items matching the filter,
+// e.g. `region=cn|us&stock!=0`. excluded candidates are never inferred and
+// get LONGMEN_SCORE_FILTERED. returns 0, or -1 if the filter is invalid
+int longmen_user_ctx_filter(void *ctx, char *filter, int len);
+// candidates repeated in items are inferred once and share the score,
+// returns how many candidates repeated an earlier one
+int longmen_forward_ctx(void *ctx, char *items, int32_t *offsets, int size,
+                        float *scores);
+int longmen_forward_ctx_u64(void *ctx, uint64_t *items, int size,
+                            float *scores);
+
+// score the whole pool for the user of ctx, two tower models only.
+// writes the pool rows and scores of the top k items in descending order
+// and returns how many were written, at most the pool size
+int longmen_retrieve(void *ctx, int k, int64_t *rows, float *scores);
+// items in the pool
+int64_t longmen_pool_size(void *model);
+// copy the key of a pool row into buf, returns its length or -1
+int longmen_pool_key(void *model, int64_t row, char *buf, int cap);
+
+// Slot of the served model for hot swaps. Calls through the handle pin an
+// epoch of their thread instead of counting references, a published model
+// replaces the current one and the previous model is freed once the calls
+// and the user contexts using it are done. Until the first publish the
+// calls do nothing and the contexts are nullptr.
+void *longmen_handle_new();
+// frees the current model as well
+void longmen_handle_del(void *handle);
+// the handle owns the model afterwards, blocks until the previous one is
+// freed
+void longmen_handle_publish(void *handle, void *model);
+// the context keeps its model alive, whatever is published meanwhile
+void *longmen_handle_user_ctx_new(void *handle, char *user_features,
+                                  int len);
+void *longmen_handle_user_ctx_new_bin(void *handle, char *user_features,
+                                      int len);
+void *longmen_handle_user_ctx_from_rows(void *handle, void *rows);
+
+// copy the description of the model inputs and outputs into buf, returns
+// the length of the whole description, which may be more than cap
+int longmen_describe(void *model, char *buf, int cap);
+
+// processed rows held by a lazy pool and its capacity, the lookups served
+// from them and the ones which processed their item. all 0 for a pool
+// processed at load
+void longmen_pool_stats(void *model, int64_t *processed, int64_t *capacity,
+                        int64_t *hits, int64_t *misses);
+// copy the k most read items held by a lazy pool into buf, one `key\thits`
+// line each, returns the length of the whole list like longmen_describe
+int longmen_pool_hot(void *model, int k, char *buf, int cap);
+void longmen_handle_pool_stats(void *handle, int64_t *processed,
+                               int64_t *capacity, int64_t *hits,
+                               int64_t *misses);
+int longmen_handle_pool_hot(void *handle, int k, char *buf, int cap);
+
+// bytes of the pool and workspace buffers, and how many of them are huge
+// page backed
+void longmen_hugepage_stats(int64_t *allocated, int64_t *backed);
 #ifdef __cplusplus
 } /* end extern "C"*/
 #endif
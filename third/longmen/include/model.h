@@ -20,51 +20,85 @@
 
 #pragma once
 
+#include "backend.h"
+#include "codec.h"
+#include "filter.h"
+#include "hnsw.h"
+#include "longmen.h"
+#include "pool.h"
 #include "toolkit.h"
+#include "topology.h"
+#include <atomic>
 #include <filesystem>
 #include <torch/script.h>
 #include <vector>
 
-class Tensor {
+// shards of the live user context count of a model
+#define MODEL_CONTEXT_SHARDS 64
+
+// TorchScript backend.
+// Two tower models export `user_tower` and `item_tower` over the user and
+// item placer groups, optionally with `head(user, item)` scoring their
+// outputs, the score is their dot product otherwise.
+class TorchModel : public Backend {
 public:
-  Tensor() = delete;
-  Tensor(int64_t rows, int64_t cols, int64_t stride, torch::Dtype type);
-  ~Tensor();
-  void set_row(int64_t row, char *data);
-  void print();
+  TorchModel() = delete;
+  TorchModel(const TorchModel &) = delete;
+  TorchModel(const TorchModel &&) = delete;
+  // with bf16 precision the float inputs and the weights are bf16
+  TorchModel(std::string_view path, int precision, int replicas,
+             int replica_policy);
+  ~TorchModel() override;
+  void forward(Input &inputs, float *result) override;
+  torch::Tensor user_tower(Input &inputs) override;
+  torch::Tensor item_tower(Input &inputs) override;
+  void head(torch::Tensor user, torch::Tensor item, float *result) override;
+  std::string describe() override;
+
+private:
+  std::vector<torch::jit::IValue> to_values(Input &inputs);
+  // replica of the calling thread
+  size_t replica();
+  // float32 output of the method, in bf16 until it fails once
+  torch::Tensor run(const std::string &method,
+                    std::vector<torch::jit::IValue> values);
 
 public:
-  int64_t m_rows;
-  int64_t m_cols;
-  int64_t m_stride;
-  torch::Dtype m_type;
-  char *m_data;
+  std::atomic<bool> m_bf16;
+  int m_replica_policy;
+
+private:
+  std::vector<torch::jit::Module> modules_;
+  std::vector<torch::jit::Module> bf16_modules_;
 };
 
-class Input {
-public:
-  Input() = delete;
-  Input(int size);
-  ~Input();
-  Tensor *&operator[](int index);
-  void print();
+class Model;
 
-public:
-  int m_size;
-  Tensor **m_tensors;
+// Processed user features with the toolkit which processed them, kept
+// to score the same user with another model of an identical toolkit
+struct UserRows {
+  uint64_t m_toolkit_hash;
+  std::shared_ptr<luban::Rows> m_rows;
 };
 
-class TorchModel {
+// Processed user features, shared by every forward call of one user
+class UserContext {
 public:
-  TorchModel() = delete;
-  TorchModel(const TorchModel &) = delete;
-  TorchModel(const TorchModel &&) = delete;
-  TorchModel(std::string_view path);
-  ~TorchModel();
-  void forward(Input &inputs, float *result);
+  UserContext() = delete;
+  UserContext(const UserContext &) = delete;
+  UserContext(const UserContext &&) = delete;
+  // the model is not freed by a publish while it has user contexts
+  UserContext(Model *model, luban::SharedFeaturesPtr user_feas);
+  UserContext(Model *model, std::shared_ptr<luban::Rows> rows);
+  ~UserContext();
 
-private:
-  torch::jit::Module module_;
+public:
+  Model *m_model;
+  std::shared_ptr<luban::Rows> m_rows;
+  // [1, dim] user tower output of two tower models
+  torch::Tensor m_user_tower;
+  // candidate filter, nullptr keeps every candidate
+  std::unique_ptr<Filter> m_filter;
 };
 
 class Model {
@@ -73,15 +107,84 @@ public:
   Model(const Model &) = delete;
   Model(const Model &&) = delete;
   Model(std::string_view pool, std::string_view key, std::string_view toolkit,
-        std::string_view model);
+        std::string_view model, const longmen_options_t &options);
   ~Model() = default;
   void forward(char *user_features, size_t len, char **items, int64_t *lens,
                int size, float *scores);
+  void forward(char *user_features, size_t len, char *items, int32_t *offsets,
+               int size, float *scores);
+  void forward(char *user_features, size_t len, uint64_t *items, int size,
+               float *scores);
+  // repeated candidates are inferred once, returns how many candidates
+  // repeated an earlier one
+  int forward(UserContext &ctx, char *items, int32_t *offsets, int size,
+              float *scores);
+  int forward(UserContext &ctx, uint64_t *items, int size, float *scores);
+  // score the whole pool for the user, two tower models only. writes the
+  // pool rows and scores of the top k items in descending order and returns
+  // how many were written
+  int retrieve(UserContext &ctx, int k, int64_t *rows, float *scores);
+  // copy the key of a pool row into buf, returns its length or -1
+  int pool_key(int64_t row, char *buf, int cap);
+  int64_t pool_size() const;
+  int key_type() const;
+  std::string describe();
+  // row cache of a lazy pool, zeros and an empty list otherwise
+  void pool_stats(int64_t *processed, int64_t *capacity, int64_t *hits,
+                  int64_t *misses);
+  // `key\thits` lines of the k most read cached items
+  std::string pool_hot(int k);
+
+  // filter the candidates of ctx by the pool attributes, an empty expression
+  // clears the filter. false if the expression is invalid
+  bool set_filter(UserContext &ctx, std::string_view expr);
+
+  // nullptr if the binary user features are malformed
+  UserContext *new_user_context(char *user_features, size_t len, bool bin);
+  // nullptr if the rows were processed by a different toolkit
+  UserContext *new_user_context(const UserRows &rows);
+  std::shared_ptr<luban::Rows> process_user(luban::SharedFeaturesPtr user_feas);
+  torch::Tensor user_tower(luban::Rows &user_rows);
+  // live user contexts, exact once no new ones can be created
+  int64_t contexts() const;
+
+public:
+  // live user contexts, counted in the shard of the calling thread so
+  // requests on different cores do not write the same cache line. a context
+  // freed on another thread leaves one shard negative, only the sum counts
+  struct alignas(64) ContextCount {
+    std::atomic<int64_t> n{0};
+  };
+  ContextCount m_contexts[MODEL_CONTEXT_SHARDS];
+  // content hash of the toolkit config
+  uint64_t m_toolkit_hash;
+
+private:
+  Tensor *new_tensor(int id, int64_t rows);
+  void apply_filter(UserContext &ctx, int64_t *rows, int size);
+  int forward_rows(UserContext &ctx, int64_t *rows, int size, float *scores);
+  void forward_items(UserContext &ctx, int64_t *rows, int size, float *scores);
+  void forward_towers(UserContext &ctx, int64_t *rows, int size,
+                      float *scores);
+  void build_item_tower();
+  void score_towers(UserContext &ctx, int64_t start, int64_t n,
+                    float *scores);
+  const float *padded_user(UserContext &ctx);
+  void build_index(std::string_view pool, const longmen_options_t &options);
+  int search_index(UserContext &ctx, int k, int64_t *rows, float *scores);
 
 private:
   std::shared_ptr<luban::Toolkit> m_toolkit;
-  std::shared_ptr<TorchModel> m_model;
-  std::unordered_map<std::string, std::shared_ptr<luban::Rows>> m_pool;
+  std::shared_ptr<Backend> m_model;
+  std::shared_ptr<Pool> m_pool;
+  std::shared_ptr<HNSW> m_index;
+  int m_ann_ef;
+  // huge page policy of the input workspaces
+  int m_huge_page;
+  // position of each group id in the toolkit groups
+  std::unordered_map<int, size_t> m_group_pos;
+  // by position, whether the user or the item placer writes the group
+  std::vector<bool> m_placed;
 };
 
 #endif // LONGMAN_MODEL_H
\ No newline at end of file
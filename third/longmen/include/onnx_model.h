@@ -0,0 +1,47 @@
+//
+// `LongMen` - 'Torch Model inference in c++'
+// Copyright (C) 2019 - present timepi <timepi123@gmail.com>
+// LongMen is provided under: GNU Affero General Public License (AGPL3.0)
+// https://www.gnu.org/licenses/agpl-3.0.html unless stated otherwise.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU Affero General Public License for more details.
+//
+//
+
+#ifndef LONGMAN_ONNX_MODEL_H
+#define LONGMAN_ONNX_MODEL_H
+
+#pragma once
+
+#include "backend.h"
+#include <onnxruntime_cxx_api.h>
+#include <string_view>
+#include <vector>
+
+// Pointwise model exported to onnx. The graph inputs are fed positionally
+// with the toolkit groups, the first graph output is the score.
+class OnnxModel : public Backend {
+public:
+  OnnxModel() = delete;
+  OnnxModel(const OnnxModel &) = delete;
+  OnnxModel(const OnnxModel &&) = delete;
+  OnnxModel(std::string_view path);
+  ~OnnxModel() = default;
+  void forward(Input &inputs, float *result) override;
+  std::string describe() override;
+
+private:
+  Ort::Env m_env;
+  Ort::Session m_session;
+  std::vector<std::string> m_inputs;
+  std::vector<std::string> m_outputs;
+};
+
+#endif // LONGMAN_ONNX_MODEL_H
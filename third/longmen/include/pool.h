@@ -0,0 +1,226 @@
+//
+// `LongMen` - 'Torch Model inference in c++'
+// Copyright (C) 2019 - present timepi <timepi123@gmail.com>
+// LongMen is provided under: GNU Affero General Public License (AGPL3.0)
+// https://www.gnu.org/licenses/agpl-3.0.html unless stated otherwise.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU Affero General Public License for more details.
+//
+//
+
+#ifndef LONGMAN_POOL_H
+#define LONGMAN_POOL_H
+
+#pragma once
+
+#include "filter.h"
+#include "longmen.h"
+#include "row_cache.h"
+#include "toolkit.h"
+#include "topology.h"
+#include <memory>
+#include <string_view>
+#include <vector>
+
+// number of candidates the batched lookup runs ahead of the probe
+#define POOL_PREFETCH_DISTANCE 8
+
+// dot product of two item tower rows, independent lanes let the loop
+// vectorize without reassociation
+inline float dot(const float *a, const float *b, int64_t n) {
+  float lanes[16] = {0};
+  int64_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    for (int j = 0; j < 16; j++) {
+      lanes[j] += a[i + j] * b[i + j];
+    }
+  }
+  float sum = 0;
+  for (; i < n; i++) {
+    sum += a[i] * b[i];
+  }
+  for (int j = 0; j < 16; j++) {
+    sum += lanes[j];
+  }
+  return sum;
+}
+
+// Processed item pool.
+// Every item's processed groups are stored back to back in one flat buffer,
+// one fixed-size row per item, and the item keys are indexed by an
+// open-addressing hash table which maps a key to its row index.
+// With `LONGMEN_KEY_UINT64` the keys are parsed as unsigned integers once at
+// load, so lookups never touch strings. The categorical attributes named in
+// the options are indexed into row sets for candidate filtering.
+// Float32 groups may be stored in fewer bytes, see `LONGMEN_STORE_*`, and
+// are decoded by `gather`.
+// With `LONGMEN_NUMA_REPLICATE` the rows and the item tower are copied to
+// every NUMA node, and readers get the copy of the node they run on.
+// A lazy pool, see `lazy_rows`, maps the pool file and keeps the offsets of
+// the raw item features instead of the rows. Items are processed on their
+// first lookup into a bounded row cache, the attributes and the item tower
+// are still built at load.
+class Pool {
+public:
+  Pool() = delete;
+  Pool(const Pool &) = delete;
+  Pool(const Pool &&) = delete;
+  // the hashes are the ones of the pool file and of the toolkit config,
+  // which key the processed pool cache. a lazy pool keeps the toolkit
+  Pool(std::string_view path, uint64_t pool_hash,
+       std::shared_ptr<luban::Toolkit> toolkit, uint64_t toolkit_hash,
+       const longmen_options_t &options);
+  ~Pool();
+
+  // pools processed from the same content by an identical toolkit with the
+  // same options are shared by the models loading them while one of them
+  // lives. the item tower is written by its model, so two tower models must
+  // not share their pool
+  static std::string share_key(uint64_t pool_hash, uint64_t toolkit_hash,
+                               const longmen_options_t &options);
+  // nullptr if no model holds a pool of the key
+  static std::shared_ptr<Pool> find_shared(const std::string &key);
+  // share the pool under the key, or return the one shared meanwhile
+  static std::shared_ptr<Pool> share(const std::string &key,
+                                     std::shared_ptr<Pool> pool);
+
+  // row index of the key, -1 if not found
+  int64_t find(std::string_view key) const;
+  int64_t find(uint64_t key) const;
+
+  // resolve a batch of keys into row indices, -1 for the missing ones.
+  // all keys are hashed first, then the slots are prefetched
+  // `POOL_PREFETCH_DISTANCE` candidates ahead of the probe, the keys they
+  // point to half as far ahead, and the rows once found.
+  void lookup(char **items, int64_t *lens, int size, int64_t *rows) const;
+  void lookup(char *items, int32_t *offsets, int size, int64_t *rows) const;
+  void lookup(uint64_t *items, int size, int64_t *rows) const;
+
+  // processed row of an item, held for its reader in a lazy pool
+  struct RowRef {
+    const char *data;
+    RowCache::Row hold;
+  };
+  RowRef fetch(int64_t index) const;
+  // start loading the row of a pool processed at load into the cache
+  void prefetch_row(int64_t index) const;
+
+  // decode the group of a row into dst as the processed luban group, fetch
+  // the row once for all of its groups
+  void gather(const RowRef &row, size_t group, char *dst) const;
+
+  // the cached rows of a lazy pool, nullptr otherwise
+  RowCache *row_cache() const { return m_cache.get(); }
+
+  // copy the key of a row into buf, returns its length or -1
+  int key(int64_t index, char *buf, int cap) const;
+
+  // storage for the item tower outputs of two tower models, rows are padded
+  // to whole cache lines and the matrix is cache line aligned
+  void alloc_tower(int64_t dim);
+  // copy the filled item tower to the other nodes
+  void replicate_tower();
+  float *tower(int64_t index) const {
+    return m_node_tower[current_node()] + index * m_tower_stride;
+  }
+
+private:
+  struct Slot {
+    uint64_t hash;
+    int64_t row;
+  };
+
+  // layout of an item placer group inside a row
+  struct Group {
+    int64_t offset;
+    // bytes of the processed luban group
+    int64_t bytes;
+    // float values of a group stored as `store`, 0 if stored as is
+    int64_t floats;
+    int store;
+  };
+
+  // start of each raw item line of a lazy pool in the mapped file
+  struct Blob {
+    uint64_t offset;
+    uint32_t key_len;
+    uint32_t len;
+  };
+
+  char *row(int64_t index) const {
+    return m_node_data[current_node()] + index * m_row_bytes;
+  }
+  std::string_view key_at(int64_t index) const {
+    if (m_map == nullptr) {
+      return m_keys[index];
+    }
+    return {m_map + m_blobs[index].offset, m_blobs[index].key_len};
+  }
+
+  void process(std::string_view path, luban::Toolkit &toolkit);
+  void map(std::string_view path);
+  RowCache::Row process_row(int64_t index) const;
+  void seal_attributes();
+  // processed rows, keys and attributes saved once processed, false if the
+  // cache file is missing or does not match
+  bool load_cache(const std::string &path);
+  void save_cache(const std::string &path) const;
+  void append(luban::Rows &rows);
+  void encode(luban::Rows &rows, char *dst) const;
+  // page memory for the rows, written in place while loading so the pool
+  // is never copied, then copied to the other nodes by replicate_rows
+  char *alloc_rows(int64_t rows);
+  void replicate_rows();
+  // page allocated copy placed on the node, or as the policy says if -1
+  void *place(const void *src, size_t bytes, int node);
+  void add_attributes(luban::Features &features);
+  void build_index();
+  int64_t probe(uint64_t hash, std::string_view key) const;
+  int64_t probe(uint64_t hash, uint64_t key) const;
+  void prefetch_key(uint64_t hash) const;
+  template <typename Key>
+  void lookup(Key &&key, int size, int64_t *rows) const;
+  template <typename Probe>
+  void lookup(const uint64_t *hashes, int size, int64_t *rows,
+              Probe &&probe) const;
+
+public:
+  int m_key_type;
+  int m_numa;
+  int m_huge_page;
+  int64_t m_size;
+  int64_t m_row_bytes;
+  int64_t m_tower_dim;
+  int64_t m_tower_stride;
+  Attributes m_attributes;
+
+private:
+  // luban row index of each item placer group
+  std::vector<int> m_indexes;
+  std::vector<Group> m_groups;
+  int64_t m_capacity;
+  char *m_data;
+  std::vector<std::string> m_keys;
+  std::vector<uint64_t> m_ukeys;
+  std::vector<Slot> m_slots;
+  uint64_t m_mask;
+  float *m_tower;
+  // rows and item tower read on each node
+  std::vector<char *> m_node_data;
+  std::vector<float *> m_node_tower;
+  // lazy pool
+  std::shared_ptr<luban::Toolkit> m_toolkit;
+  char *m_map;
+  size_t m_map_bytes;
+  std::vector<Blob> m_blobs;
+  std::unique_ptr<RowCache> m_cache;
+};
+
+#endif // LONGMAN_POOL_H
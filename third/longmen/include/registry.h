@@ -0,0 +1,78 @@
+//
+// `LongMen` - 'Torch Model inference in c++'
+// Copyright (C) 2019 - present timepi <timepi123@gmail.com>
+// LongMen is provided under: GNU Affero General Public License (AGPL3.0)
+// https://www.gnu.org/licenses/agpl-3.0.html unless stated otherwise.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU Affero General Public License for more details.
+//
+//
+
+#ifndef LONGMAN_REGISTRY_H
+#define LONGMAN_REGISTRY_H
+
+#pragma once
+
+#include "model.h"
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+
+// Epoch based reclamation of served models.
+// A reader pins the global epoch in a slot owned by its thread for the
+// duration of a call, so the hot path writes only to its own cache line.
+// A publisher bumps the epoch and waits until no slot still holds an
+// older one before freeing what it replaced.
+class EpochGuard {
+public:
+  EpochGuard();
+  EpochGuard(const EpochGuard &) = delete;
+  ~EpochGuard();
+};
+
+// wait until every reader pinned before the call has left
+void synchronize_epochs();
+
+// Slot of the served model, swapped without stopping the readers. T counts
+// the user contexts which outlive the calls with contexts(), a Model but
+// for the tests.
+template <typename T> class Handle {
+public:
+  Handle() : m_model(nullptr) {}
+  Handle(const Handle &) = delete;
+  Handle(const Handle &&) = delete;
+  ~Handle() { publish(nullptr); }
+  // current model, nullptr before the first publish. only valid while an
+  // EpochGuard of the calling thread is alive
+  T *get() { return m_model.load(); }
+  // make model current and free the previous one once the calls and user
+  // contexts using it are done, blocks until then
+  void publish(T *model) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    T *old = m_model.exchange(model);
+    if (old == nullptr || old == model) {
+      return;
+    }
+    synchronize_epochs();
+    while (old->contexts() > 0) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    delete old;
+  }
+
+private:
+  std::atomic<T *> m_model;
+  std::mutex m_mutex;
+};
+
+using ModelHandle = Handle<Model>;
+
+#endif // LONGMAN_REGISTRY_H
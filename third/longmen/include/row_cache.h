@@ -0,0 +1,97 @@
+//
+// `LongMen` - 'Torch Model inference in c++'
+// Copyright (C) 2019 - present timepi <timepi123@gmail.com>
+// LongMen is provided under: GNU Affero General Public License (AGPL3.0)
+// https://www.gnu.org/licenses/agpl-3.0.html unless stated otherwise.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU Affero General Public License for more details.
+//
+//
+
+#ifndef LONGMAN_ROW_CACHE_H
+#define LONGMAN_ROW_CACHE_H
+
+#pragma once
+
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// shards of the row cache, each with its own lock
+#define ROW_CACHE_SHARDS 64
+
+// Bounded cache of the processed rows of a lazy pool, by pool row.
+// Rows are spread over shards so lookups of different items rarely
+// contend, and each shard evicts its least recently used row when full.
+// A row stays valid while a reader holds it, even once evicted.
+// Every shard holds at least one row, so the capacity is at least
+// ROW_CACHE_SHARDS rows. Above that the shards hold the capacity exactly,
+// the first `capacity % ROW_CACHE_SHARDS` of them one row more.
+class RowCache {
+public:
+  using Row = std::shared_ptr<const char>;
+
+  RowCache() = delete;
+  RowCache(const RowCache &) = delete;
+  RowCache(const RowCache &&) = delete;
+  explicit RowCache(int64_t capacity);
+  ~RowCache() = default;
+
+  // nullptr if the row is not cached
+  Row get(int64_t index);
+  // cache the row, returns the one cached meanwhile by another thread if any
+  Row put(int64_t index, Row row);
+
+  // the k cached rows read the most since they were cached, with their hits
+  std::vector<std::pair<int64_t, int64_t>> hot(int k);
+  int64_t size() const { return m_size.load(); }
+  // lookups served from the cache and the ones which missed, summed over
+  // the shards
+  int64_t hits() const;
+  int64_t misses() const;
+
+public:
+  // rows held at most, the requested capacity raised to the minimum
+  int64_t m_capacity;
+
+private:
+  struct Entry {
+    Row row;
+    int64_t hits;
+    // position in the recency list of the shard
+    std::list<int64_t>::iterator pos;
+  };
+
+  struct alignas(64) Shard {
+    std::mutex mutex;
+    int64_t capacity;
+    // most recently used first
+    std::list<int64_t> recency;
+    std::unordered_map<int64_t, Entry> entries;
+    // counted under the lock on the cache line it already holds, atomic
+    // for the readers of the stats
+    std::atomic<int64_t> hits{0};
+    std::atomic<int64_t> misses{0};
+  };
+
+  Shard &shard(int64_t index) {
+    return m_shards[uint64_t(index) % ROW_CACHE_SHARDS];
+  }
+
+private:
+  std::atomic<int64_t> m_size;
+  Shard m_shards[ROW_CACHE_SHARDS];
+};
+
+#endif // LONGMAN_ROW_CACHE_H
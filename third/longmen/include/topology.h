@@ -0,0 +1,45 @@
+//
+// `LongMen` - 'Torch Model inference in c++'
+// Copyright (C) 2019 - present timepi <timepi123@gmail.com>
+// LongMen is provided under: GNU Affero General Public License (AGPL3.0)
+// https://www.gnu.org/licenses/agpl-3.0.html unless stated otherwise.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU Affero General Public License for more details.
+//
+//
+
+#ifndef LONGMAN_TOPOLOGY_H
+#define LONGMAN_TOPOLOGY_H
+
+#pragma once
+
+#include <stddef.h>
+
+// NUMA nodes of the host, read once from sysfs. Nodes are numbered densely
+// from 0 to node_count() - 1 whatever their kernel ids are, a host without
+// NUMA information has a single node.
+int node_count();
+
+// node of the cpu the calling thread runs on, refreshed by refresh_node.
+// threads start on node 0 until their first refresh
+extern thread_local int t_current_node;
+inline int current_node() { return t_current_node; }
+void refresh_node();
+
+// memory policy of a page aligned range which is not touched yet, done by
+// the mbind syscall. false if the kernel refuses it
+bool bind_node(void *ptr, size_t len, int node);
+bool interleave_nodes(void *ptr, size_t len);
+
+// whether the cpu has bf16 matrix instructions, AVX512-BF16 or AMX-BF16,
+// and the os saves the AVX-512 state
+bool cpu_has_bf16();
+
+#endif // LONGMAN_TOPOLOGY_H
@@ -0,0 +1,152 @@
+#include "backend.h"
+
+#include "hugepage.h"
+#include <cstring>
+#include <iostream>
+
+// free tensor buffers kept per size class and thread
+#define TENSOR_CACHE_BLOCKS 8
+
+namespace {
+
+// Tensor buffers are recycled through a per thread cache of cache line
+// aligned blocks in power of two size classes. Every row of a tensor is
+// written before inference, so blocks are handed out without zeroing and
+// the steady state neither allocates nor touches fresh pages. The threads
+// serve models with different huge page policies, each policy has its own
+// free blocks.
+class BufferCache {
+public:
+  ~BufferCache() {
+    for (auto &classes : m_free) {
+      for (int c = 0; c < 64; c++) {
+        for (char *block : classes[c]) {
+          release(block, c);
+        }
+      }
+    }
+  }
+
+  static BufferCache &local() {
+    thread_local BufferCache cache;
+    return cache;
+  }
+
+  char *get(size_t bytes, int policy) {
+    int c = size_class(bytes);
+    auto &free = m_free[policy][c];
+    if (!free.empty()) {
+      char *block = free.back();
+      free.pop_back();
+      return block;
+    }
+    // blocks of a huge page and more follow the huge page policy
+    char *block = (size_t(1) << c) >= HUGEPAGE_SIZE
+                      ? (char *)page_alloc(size_t(1) << c, policy)
+                      : (char *)aligned_alloc(64, size_t(1) << c);
+    if (block == nullptr) {
+      std::cerr << "alloc tensor: " << bytes << " bytes error" << std::endl;
+      exit(-1);
+    }
+    return block;
+  }
+
+  void put(char *block, size_t bytes, int policy) {
+    int c = size_class(bytes);
+    auto &free = m_free[policy][c];
+    if (free.size() >= TENSOR_CACHE_BLOCKS) {
+      release(block, c);
+      return;
+    }
+    free.push_back(block);
+  }
+
+  static void release(char *block, int c) {
+    if ((size_t(1) << c) >= HUGEPAGE_SIZE) {
+      page_free(block);
+    } else {
+      free(block);
+    }
+  }
+
+private:
+  static int size_class(size_t bytes) {
+    int c = 6;
+    while ((size_t(1) << c) < bytes) {
+      c++;
+    }
+    return c;
+  }
+
+  std::vector<char *> m_free[LONGMEN_HUGEPAGE_HUGETLB + 1][64];
+};
+
+} // namespace
+
+Tensor::Tensor(int64_t rows, int64_t cols, int64_t stride, torch::Dtype type,
+               int huge_page)
+    : m_rows(rows), m_cols(cols), m_stride(stride), m_type(type),
+      m_huge_page(huge_page) {
+  if (m_huge_page < LONGMEN_HUGEPAGE_OFF ||
+      m_huge_page > LONGMEN_HUGEPAGE_HUGETLB) {
+    m_huge_page = LONGMEN_HUGEPAGE_OFF;
+  }
+  m_data = BufferCache::local().get(m_rows * m_cols * m_stride, m_huge_page);
+}
+
+Tensor::~Tensor() {
+  if (m_data != nullptr) {
+    BufferCache::local().put(m_data, m_rows * m_cols * m_stride, m_huge_page);
+    m_data = nullptr;
+  }
+}
+
+void Tensor::print() {
+  std::cout << "[";
+  for (int64_t i = 0; i < m_rows; i++) {
+    if (i > 0) {
+      std::cout << "\n";
+    }
+    std::cout << "[";
+    for (int64_t j = 0; j < m_cols; j++) {
+      if (j > 0) {
+        std::cout << ",";
+      }
+      if (m_type == torch::kFloat32) {
+        std::cout << ((float *)m_data)[i * m_cols + j];
+      } else {
+        std::cout << ((int64_t *)m_data)[i * m_cols + j];
+      }
+    }
+    std::cout << "]";
+  }
+  std::cout << "]" << std::endl;
+}
+
+void Tensor::set_row(int64_t row, char *data) {
+  memcpy(&m_data[m_cols * m_stride * row], data, m_cols * m_stride);
+}
+
+Input::Input(int size) : m_size(size) {
+  m_tensors = (Tensor **)calloc(m_size, sizeof(Tensor *));
+}
+
+Input::~Input() {
+  for (int i = 0; i < m_size; i++) {
+    if (m_tensors[i] != nullptr) {
+      delete m_tensors[i];
+      m_tensors[i] = nullptr;
+    }
+  }
+  free(m_tensors);
+  m_tensors = nullptr;
+}
+
+Tensor *&Input::operator[](int index) { return m_tensors[index]; }
+
+void Input::print() {
+  for (int i = 0; i < m_size; i++) {
+    m_tensors[i]->print();
+    std::cout << std::endl;
+  }
+}
@@ -0,0 +1,272 @@
+#include "codec.h"
+
+#include <cstring>
+
+#ifdef LONGMEN_USE_SIMDJSON
+#include <simdjson.h>
+#endif
+
+namespace {
+
+class Reader {
+public:
+  Reader(const char *data, size_t len) : m_data(data), m_end(data + len) {}
+
+  template <typename T> bool read(T &value) {
+    if (size_t(m_end - m_data) < sizeof(T)) {
+      return false;
+    }
+    memcpy(&value, m_data, sizeof(T));
+    m_data += sizeof(T);
+    return true;
+  }
+
+  bool read(std::string_view &value, size_t len) {
+    if (size_t(m_end - m_data) < len) {
+      return false;
+    }
+    value = {m_data, len};
+    m_data += len;
+    return true;
+  }
+
+  bool read(std::string_view &value) {
+    uint32_t len;
+    return read(len) && read(value, len);
+  }
+
+  template <typename T> bool read(std::vector<T> &values) {
+    uint32_t n;
+    if (!read(n) || size_t(m_end - m_data) < size_t(n) * sizeof(T)) {
+      return false;
+    }
+    values.resize(n);
+    // an empty vector may have no storage to copy into
+    if (n > 0) {
+      memcpy(values.data(), m_data, size_t(n) * sizeof(T));
+    }
+    m_data += size_t(n) * sizeof(T);
+    return true;
+  }
+
+  bool read(std::vector<std::string> &values) {
+    uint32_t n;
+    // every string takes at least its length, so a count the buffer can
+    // not hold is rejected before anything is allocated for it
+    if (!read(n) || size_t(m_end - m_data) / sizeof(uint32_t) < n) {
+      return false;
+    }
+    std::string_view value;
+    values.reserve(n);
+    for (uint32_t i = 0; i < n; i++) {
+      if (!read(value)) {
+        return false;
+      }
+      values.emplace_back(value);
+    }
+    return true;
+  }
+
+  bool done() const { return m_data == m_end; }
+
+private:
+  const char *m_data;
+  const char *m_end;
+};
+
+template <typename T>
+bool decode_value(Reader &reader, luban::SharedParameter &value) {
+  T v;
+  if (!reader.read(v)) {
+    return false;
+  }
+  value = std::make_shared<luban::Parameter>(std::move(v));
+  return true;
+}
+
+#ifdef LONGMEN_USE_SIMDJSON
+using namespace simdjson;
+
+template <typename T>
+bool parse_value(ondemand::value &json, luban::SharedParameter &value) {
+  T v;
+  if constexpr (std::is_same_v<T, int64_t>) {
+    if (json.get_int64().get(v)) {
+      return false;
+    }
+  } else {
+    double d;
+    if (json.get_double().get(d)) {
+      return false;
+    }
+    v = float(d);
+  }
+  value = std::make_shared<luban::Parameter>(v);
+  return true;
+}
+
+template <typename T>
+bool parse_values(ondemand::value &json, luban::SharedParameter &value) {
+  ondemand::array array;
+  if (json.get_array().get(array)) {
+    return false;
+  }
+  std::vector<T> values;
+  for (auto element : array) {
+    if constexpr (std::is_same_v<T, int64_t>) {
+      int64_t v;
+      if (element.get_int64().get(v)) {
+        return false;
+      }
+      values.push_back(v);
+    } else if constexpr (std::is_same_v<T, float>) {
+      double v;
+      if (element.get_double().get(v)) {
+        return false;
+      }
+      values.push_back(float(v));
+    } else {
+      std::string_view v;
+      if (element.get_string().get(v)) {
+        return false;
+      }
+      values.emplace_back(v);
+    }
+  }
+  value = std::make_shared<luban::Parameter>(std::move(values));
+  return true;
+}
+
+luban::SharedFeaturesPtr simd_parse_features(const char *data, size_t len) {
+  thread_local ondemand::parser parser;
+  // simdjson reads up to SIMDJSON_PADDING bytes past the end of the text
+  thread_local std::vector<char> buffer;
+  if (buffer.size() < len + SIMDJSON_PADDING) {
+    buffer.resize(len + SIMDJSON_PADDING);
+  }
+  memcpy(buffer.data(), data, len);
+
+  ondemand::document doc;
+  ondemand::object object;
+  if (parser.iterate(buffer.data(), len, buffer.size()).get(doc) ||
+      doc.get_object().get(object)) {
+    return nullptr;
+  }
+
+  auto features = std::make_shared<luban::Features>();
+  std::string name;
+  int64_t type;
+  luban::SharedParameter value;
+  bool ok;
+  for (auto field : object) {
+    std::string_view key;
+    ondemand::object feature;
+    ondemand::value json;
+    if (field.unescaped_key().get(key) ||
+        field.value().get_object().get(feature)) {
+      return nullptr;
+    }
+    name = key;
+    if (feature["type"].get_int64().get(type) ||
+        feature["value"].get(json)) {
+      return nullptr;
+    }
+    switch (type) {
+    case luban::DataType::kInt64:
+      ok = parse_value<int64_t>(json, value);
+      break;
+    case luban::DataType::kFloat32:
+      ok = parse_value<float>(json, value);
+      break;
+    case luban::DataType::kString: {
+      std::string_view v;
+      ok = !json.get_string().get(v);
+      if (ok) {
+        value = std::make_shared<luban::Parameter>(std::string(v));
+      }
+      break;
+    }
+    case luban::DataType::kInt64s:
+      ok = parse_values<int64_t>(json, value);
+      break;
+    case luban::DataType::kFloat32s:
+      ok = parse_values<float>(json, value);
+      break;
+    case luban::DataType::kStrings:
+      ok = parse_values<std::string>(json, value);
+      break;
+    default:
+      ok = false;
+    }
+    if (!ok) {
+      return nullptr;
+    }
+    features->insert(name, value);
+  }
+  return features;
+}
+#endif
+
+} // namespace
+
+luban::SharedFeaturesPtr parse_features(const char *data, size_t len) {
+#ifdef LONGMEN_USE_SIMDJSON
+  auto features = simd_parse_features(data, len);
+  if (features != nullptr) {
+    return features;
+  }
+  // anything simdjson rejects is left to luban, so both builds accept
+  // exactly the same input
+#endif
+  return std::make_shared<luban::Features>(std::string_view{data, len});
+}
+
+luban::SharedFeaturesPtr decode_features(const char *data, size_t len) {
+  Reader reader(data, len);
+  uint32_t count;
+  if (!reader.read(count)) {
+    return nullptr;
+  }
+
+  auto features = std::make_shared<luban::Features>();
+  uint8_t type;
+  uint16_t nlen;
+  std::string_view name, str;
+  luban::SharedParameter value;
+  bool ok;
+  for (uint32_t i = 0; i < count; i++) {
+    if (!reader.read(type) || !reader.read(nlen) || !reader.read(name, nlen)) {
+      return nullptr;
+    }
+    switch (type) {
+    case luban::DataType::kInt64:
+      ok = decode_value<int64_t>(reader, value);
+      break;
+    case luban::DataType::kFloat32:
+      ok = decode_value<float>(reader, value);
+      break;
+    case luban::DataType::kString:
+      ok = reader.read(str);
+      if (ok) {
+        value = std::make_shared<luban::Parameter>(std::string(str));
+      }
+      break;
+    case luban::DataType::kInt64s:
+      ok = decode_value<std::vector<int64_t>>(reader, value);
+      break;
+    case luban::DataType::kFloat32s:
+      ok = decode_value<std::vector<float>>(reader, value);
+      break;
+    case luban::DataType::kStrings:
+      ok = decode_value<std::vector<std::string>>(reader, value);
+      break;
+    default:
+      ok = false;
+    }
+    if (!ok) {
+      return nullptr;
+    }
+    features->insert(std::string(name), value);
+  }
+  return reader.done() ? features : nullptr;
+}
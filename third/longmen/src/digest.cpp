@@ -0,0 +1,66 @@
+#include "digest.h"
+
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#define DIGEST_CHUNK_SIZE (1 << 20)
+
+static inline uint64_t mix(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+uint64_t hash_bytes(const void *data, size_t len, uint64_t seed) {
+  const char *p = (const char *)data;
+  // four independent lanes over 32 byte blocks, folded at the end
+  uint64_t lanes[4] = {seed, seed ^ 0x9e3779b97f4a7c15ULL,
+                       seed ^ 0xbf58476d1ce4e5b9ULL,
+                       seed ^ 0x94d049bb133111ebULL};
+  size_t i = 0;
+  for (; i + 32 <= len; i += 32) {
+    for (int l = 0; l < 4; l++) {
+      uint64_t v;
+      memcpy(&v, p + i + l * 8, 8);
+      lanes[l] = (lanes[l] ^ mix(v)) * 0x9e3779b97f4a7c15ULL;
+    }
+  }
+  uint64_t h = len;
+  for (int l = 0; l < 4; l++) {
+    h = mix(h ^ lanes[l]);
+  }
+  for (; i < len; i++) {
+    h = (h ^ (unsigned char)p[i]) * 0x100000001b3ULL;
+  }
+  return mix(h);
+}
+
+uint64_t hash_file(std::string_view path) {
+  std::ifstream reader(std::string(path), std::ios::binary);
+  if (!reader) {
+    return 0;
+  }
+  std::vector<char> buf(DIGEST_CHUNK_SIZE);
+  uint64_t h = 0;
+  while (reader) {
+    reader.read(buf.data(), buf.size());
+    if (reader.gcount() > 0) {
+      h = hash_bytes(buf.data(), reader.gcount(), h);
+    }
+  }
+  return h;
+}
+
+std::string temp_path(std::string_view path) {
+  size_t thread = std::hash<std::thread::id>()(std::this_thread::get_id());
+  return std::string(path) + "." + std::to_string(getpid()) + "." +
+         std::to_string(thread) + ".tmp";
+}
@@ -0,0 +1,134 @@
+#include "filter.h"
+
+#include <algorithm>
+#include <cstdlib>
+
+BitMap *new_bitmap(int size) {
+  int c_size = (size >> 3) + 1;
+  return (BitMap *)calloc(c_size, sizeof(BitMap));
+}
+void free_bitmap(BitMap *data) { free(data); }
+void set_bitmap(BitMap *bitMap, int index) {
+  int byteIndex = index >> 3;
+  int offset = index & 7;
+  bitMap[byteIndex] |= (1 << offset);
+}
+int check_bitmap(BitMap *bitMap, int index) {
+  int byteIndex = index >> 3;
+  int offset = index & 7;
+  return (bitMap[byteIndex] & (1 << offset)) != 0;
+}
+
+static std::string_view trim(std::string_view s) {
+  while (!s.empty() && s.front() == ' ') {
+    s.remove_prefix(1);
+  }
+  while (!s.empty() && s.back() == ' ') {
+    s.remove_suffix(1);
+  }
+  return s;
+}
+
+RowSet::RowSet(RowSet &&other) noexcept
+    : m_rows(std::move(other.m_rows)), m_bitmap(other.m_bitmap) {
+  other.m_bitmap = nullptr;
+}
+
+RowSet::~RowSet() {
+  if (m_bitmap != nullptr) {
+    free_bitmap(m_bitmap);
+    m_bitmap = nullptr;
+  }
+}
+
+void RowSet::add(int64_t row) {
+  if (m_rows.empty() || m_rows.back() != uint32_t(row)) {
+    m_rows.push_back(uint32_t(row));
+  }
+}
+
+void RowSet::seal(int64_t size) {
+  // an array costs 32 bits per row, the bitmap one bit per pool row
+  if (int64_t(m_rows.size()) * 32 <= size) {
+    m_rows.shrink_to_fit();
+    return;
+  }
+  m_bitmap = new_bitmap(size);
+  for (uint32_t row : m_rows) {
+    set_bitmap(m_bitmap, row);
+  }
+  std::vector<uint32_t>().swap(m_rows);
+}
+
+bool RowSet::contains(int64_t row) const {
+  if (m_bitmap != nullptr) {
+    return check_bitmap(m_bitmap, row);
+  }
+  return std::binary_search(m_rows.begin(), m_rows.end(), uint32_t(row));
+}
+
+std::vector<uint32_t> RowSet::rows(int64_t size) const {
+  if (m_bitmap == nullptr) {
+    return m_rows;
+  }
+  std::vector<uint32_t> rows;
+  for (int64_t row = 0; row < size; row++) {
+    if (check_bitmap(m_bitmap, row)) {
+      rows.push_back(uint32_t(row));
+    }
+  }
+  return rows;
+}
+
+Filter::Filter(const Attributes &attributes, std::string_view expr)
+    : m_valid(true) {
+  while (!trim(expr).empty()) {
+    size_t end = expr.find('&');
+    std::string_view clause = expr.substr(0, end);
+    expr = end == std::string_view::npos ? std::string_view{}
+                                         : expr.substr(end + 1);
+
+    size_t op = clause.find('=');
+    if (op == std::string_view::npos || op == 0) {
+      m_valid = false;
+      return;
+    }
+    Clause c{{}, clause[op - 1] == '!'};
+    auto attr = attributes.find(
+        std::string(trim(clause.substr(0, c.negate ? op - 1 : op))));
+    if (attr == attributes.end()) {
+      m_valid = false;
+      return;
+    }
+    std::string_view values = clause.substr(op + 1);
+    while (true) {
+      size_t sep = values.find('|');
+      // a value missing from the pool matches no row
+      auto value = attr->second.find(std::string(trim(values.substr(0, sep))));
+      if (value != attr->second.end()) {
+        c.values.push_back(&value->second);
+      }
+      if (sep == std::string_view::npos) {
+        break;
+      }
+      values = values.substr(sep + 1);
+    }
+    m_clauses.push_back(std::move(c));
+  }
+}
+
+bool Filter::check(int64_t row) const {
+  for (auto &c : m_clauses) {
+    bool in = false;
+    for (auto *value : c.values) {
+      if (value->contains(row)) {
+        in = true;
+        break;
+      }
+    }
+    if (in == c.negate) {
+      return false;
+    }
+  }
+  return true;
+}
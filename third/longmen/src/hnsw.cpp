@@ -0,0 +1,414 @@
+#include "hnsw.h"
+#include "digest.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <queue>
+#include <random>
+#include <thread>
+
+#define HNSW_LOCK_STRIPES 65536
+// bounds of an index read from a file, far above what gets built: levels
+// are drawn from -log(u) / log(m) with u >= 1e-12
+#define HNSW_MAX_M 4096
+#define HNSW_MAX_LEVEL 64
+
+namespace {
+
+const char kMagic[8] = {'L', 'M', 'H', 'N', 'S', 'W', '0', '1'};
+
+struct Header {
+  char magic[8];
+  int64_t size;
+  int64_t dim;
+  int64_t m;
+  int64_t m0;
+  int64_t max_level;
+  int64_t entry;
+  uint64_t fingerprint;
+};
+
+} // namespace
+
+HNSW::HNSW(const Pool &pool)
+    : m_size(pool.m_size), m_pool(pool), m_m(0), m_m0(0), m_ef_construction(0),
+      m_max_level(-1), m_entry(0), m_locks(HNSW_LOCK_STRIPES) {}
+
+HNSW::HNSW(const Pool &pool, int m, int ef_construction) : HNSW(pool) {
+  m_m = std::max(2, m);
+  m_m0 = m_m * 2;
+  m_ef_construction = std::max(ef_construction, m_m);
+  m_levels.resize(m_size);
+  m_links.resize(m_size);
+  m_links0.assign(m_size * (m_m0 + 1), 0);
+  if (m_size == 0) {
+    return;
+  }
+
+  // levels are drawn up front, so the graph only depends on the seed
+  std::mt19937_64 rng(m_size);
+  std::uniform_real_distribution<double> uniform(0.0, 1.0);
+  double mult = 1.0 / std::log(double(m_m));
+  for (int64_t i = 0; i < m_size; i++) {
+    m_levels[i] = int(-std::log(std::max(uniform(rng), 1e-12)) * mult);
+    if (m_levels[i] > 0) {
+      m_links[i].assign(m_levels[i] * (m_m + 1), 0);
+    }
+  }
+
+  m_entry = 0;
+  m_max_level = m_levels[0];
+  std::atomic<int64_t> next(1);
+  auto worker = [&]() {
+    for (int64_t i = next++; i < m_size; i = next++) {
+      insert(uint32_t(i));
+    }
+  };
+  int threads = std::max(1u, std::thread::hardware_concurrency());
+  std::vector<std::thread> workers;
+  for (int i = 0; i < threads; i++) {
+    workers.emplace_back(worker);
+  }
+  for (auto &t : workers) {
+    t.join();
+  }
+}
+
+std::mutex &HNSW::lock(uint32_t node) const {
+  return m_locks[node % HNSW_LOCK_STRIPES];
+}
+
+float HNSW::distance(const float *query, uint32_t node) const {
+  return -dot(query, m_pool.tower(node), m_pool.m_tower_stride);
+}
+
+uint32_t *HNSW::links(uint32_t node, int level) {
+  if (level == 0) {
+    return &m_links0[int64_t(node) * (m_m0 + 1)];
+  }
+  return &m_links[node][(level - 1) * (m_m + 1)];
+}
+
+const uint32_t *HNSW::links(uint32_t node, int level) const {
+  return const_cast<HNSW *>(this)->links(node, level);
+}
+
+void HNSW::neighbors(uint32_t node, int level, bool locked,
+                     std::vector<uint32_t> &result) const {
+  std::unique_lock<std::mutex> guard;
+  if (locked) {
+    guard = std::unique_lock<std::mutex>(lock(node));
+  }
+  const uint32_t *l = links(node, level);
+  result.assign(l + 1, l + 1 + l[0]);
+}
+
+uint32_t HNSW::greedy(const float *query, uint32_t entry, int from, int to,
+                      bool locked) const {
+  std::vector<uint32_t> next;
+  float best = distance(query, entry);
+  for (int level = from; level > to; level--) {
+    bool changed = true;
+    while (changed) {
+      changed = false;
+      neighbors(entry, level, locked, next);
+      for (uint32_t e : next) {
+        float d = distance(query, e);
+        if (d < best) {
+          best = d;
+          entry = e;
+          changed = true;
+        }
+      }
+    }
+  }
+  return entry;
+}
+
+std::vector<HNSW::Candidate> HNSW::search_layer(const float *query,
+                                                uint32_t entry, int ef,
+                                                int level, bool locked) const {
+  // visited marks are tagged with a per thread epoch, so they never need
+  // to be cleared between searches
+  thread_local std::vector<uint32_t> visited;
+  thread_local uint32_t epoch = 0;
+  if (visited.size() < size_t(m_size)) {
+    visited.resize(m_size, 0);
+  }
+  if (++epoch == 0) {
+    std::fill(visited.begin(), visited.end(), 0);
+    epoch = 1;
+  }
+
+  std::priority_queue<Candidate> top;
+  std::priority_queue<Candidate, std::vector<Candidate>, std::greater<>>
+      candidates;
+  float d = distance(query, entry);
+  top.emplace(d, entry);
+  candidates.emplace(d, entry);
+  visited[entry] = epoch;
+
+  std::vector<uint32_t> next;
+  while (!candidates.empty()) {
+    Candidate c = candidates.top();
+    if (c.first > top.top().first && int(top.size()) >= ef) {
+      break;
+    }
+    candidates.pop();
+    neighbors(c.second, level, locked, next);
+    for (uint32_t e : next) {
+      if (visited[e] == epoch) {
+        continue;
+      }
+      visited[e] = epoch;
+      d = distance(query, e);
+      if (int(top.size()) < ef || d < top.top().first) {
+        candidates.emplace(d, e);
+        top.emplace(d, e);
+        if (int(top.size()) > ef) {
+          top.pop();
+        }
+      }
+    }
+  }
+
+  std::vector<Candidate> result;
+  result.reserve(top.size());
+  while (!top.empty()) {
+    result.push_back(top.top());
+    top.pop();
+  }
+  std::reverse(result.begin(), result.end());
+  return result;
+}
+
+void HNSW::select(std::vector<Candidate> &candidates, int m) const {
+  // keep a candidate only if it is closer to the node than to every
+  // neighbor kept so far, this spreads the links out
+  std::sort(candidates.begin(), candidates.end());
+  if (int(candidates.size()) <= m) {
+    return;
+  }
+  std::vector<Candidate> result;
+  for (auto &c : candidates) {
+    bool good = true;
+    for (auto &r : result) {
+      if (distance(m_pool.tower(r.second), c.second) < c.first) {
+        good = false;
+        break;
+      }
+    }
+    if (good) {
+      result.push_back(c);
+      if (int(result.size()) >= m) {
+        break;
+      }
+    }
+  }
+  candidates.swap(result);
+}
+
+void HNSW::connect(uint32_t node, std::vector<Candidate> &candidates,
+                   int level) {
+  int m = level == 0 ? m_m0 : m_m;
+  select(candidates, m_m);
+  {
+    std::lock_guard<std::mutex> guard(lock(node));
+    uint32_t *l = links(node, level);
+    l[0] = 0;
+    for (auto &c : candidates) {
+      l[++l[0]] = c.second;
+    }
+  }
+
+  const float *vec = m_pool.tower(node);
+  for (auto &c : candidates) {
+    std::lock_guard<std::mutex> guard(lock(c.second));
+    uint32_t *l = links(c.second, level);
+    if (int(l[0]) < m) {
+      l[++l[0]] = node;
+      continue;
+    }
+    // full, shrink the neighbor's links together with the new node
+    const float *base = m_pool.tower(c.second);
+    std::vector<Candidate> shrink;
+    shrink.reserve(l[0] + 1);
+    shrink.emplace_back(-dot(base, vec, m_pool.m_tower_stride), node);
+    for (uint32_t i = 1; i <= l[0]; i++) {
+      shrink.emplace_back(distance(base, l[i]), l[i]);
+    }
+    select(shrink, m);
+    l[0] = 0;
+    for (auto &s : shrink) {
+      l[++l[0]] = s.second;
+    }
+  }
+}
+
+void HNSW::insert(uint32_t node) {
+  int level = m_levels[node];
+  std::unique_lock<std::mutex> global(m_global);
+  int max_level = m_max_level;
+  uint32_t entry = m_entry;
+  if (level <= max_level) {
+    global.unlock();
+  }
+
+  const float *query = m_pool.tower(node);
+  entry = greedy(query, entry, max_level, level, true);
+  for (int l = std::min(level, max_level); l >= 0; l--) {
+    auto candidates = search_layer(query, entry, m_ef_construction, l, true);
+    entry = candidates[0].second;
+    connect(node, candidates, l);
+  }
+
+  if (level > max_level) {
+    // still holding the global lock
+    m_max_level = level;
+    m_entry = node;
+  }
+}
+
+void HNSW::search(const float *query, int k, int ef,
+                  std::vector<std::pair<float, int64_t>> &result) const {
+  result.clear();
+  if (m_size == 0 || k <= 0) {
+    return;
+  }
+  uint32_t entry = greedy(query, m_entry, m_max_level, 0, false);
+  auto candidates = search_layer(query, entry, std::max(ef, k), 0, false);
+  for (auto &c : candidates) {
+    if (int(result.size()) >= k) {
+      break;
+    }
+    result.emplace_back(-c.first, c.second);
+  }
+}
+
+uint64_t HNSW::fingerprint(const Pool &pool) {
+  // rows are hashed without their padding, chained through the seed
+  uint64_t hash = hash_bytes(&pool.m_tower_dim, sizeof(int64_t), pool.m_size);
+  for (int64_t i = 0; i < pool.m_size; i++) {
+    hash = hash_bytes(pool.tower(i), sizeof(float) * pool.m_tower_dim, hash);
+  }
+  return hash;
+}
+
+bool HNSW::save(std::string_view path, uint64_t fingerprint) const {
+  // written aside and renamed, a crash never leaves a torn index behind
+  std::string tmp = temp_path(path);
+  std::ofstream writer(tmp, std::ios::out | std::ios::binary);
+  if (!writer) {
+    std::cerr << "write hnsw index: " << tmp << " error" << std::endl;
+    return false;
+  }
+  Header header;
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.size = m_size;
+  header.dim = m_pool.m_tower_dim;
+  header.m = m_m;
+  header.m0 = m_m0;
+  header.max_level = m_max_level;
+  header.entry = m_entry;
+  header.fingerprint = fingerprint;
+  writer.write((const char *)&header, sizeof(header));
+  writer.write((const char *)m_levels.data(), sizeof(int) * m_levels.size());
+  writer.write((const char *)m_links0.data(),
+               sizeof(uint32_t) * m_links0.size());
+  for (auto &l : m_links) {
+    writer.write((const char *)l.data(), sizeof(uint32_t) * l.size());
+  }
+  writer.close();
+  if (!writer || std::rename(tmp.c_str(), std::string(path).c_str()) != 0) {
+    std::cerr << "write hnsw index: " << path << " error" << std::endl;
+    std::remove(tmp.c_str());
+    return false;
+  }
+  return true;
+}
+
+namespace {
+
+// node links are [count, id, ...], a count beyond the degree or an id
+// beyond the pool would be followed out of bounds by the search
+bool valid_links(const uint32_t *links, int64_t degree, int64_t size) {
+  if (links[0] > degree) {
+    return false;
+  }
+  for (uint32_t k = 1; k <= links[0]; k++) {
+    if (links[k] >= size) {
+      return false;
+    }
+  }
+  return true;
+}
+
+} // namespace
+
+std::shared_ptr<HNSW> HNSW::load(std::string_view path, const Pool &pool,
+                                 uint64_t fingerprint) {
+  std::error_code error;
+  uint64_t file_size = std::filesystem::file_size(path, error);
+  std::ifstream reader(std::string(path), std::ios::in | std::ios::binary);
+  if (error || !reader) {
+    return nullptr;
+  }
+  std::shared_ptr<HNSW> index(new HNSW(pool));
+  Header header;
+  if (!reader.read((char *)&header, sizeof(header)) ||
+      memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 ||
+      header.size != pool.m_size || header.dim != pool.m_tower_dim ||
+      header.fingerprint != fingerprint) {
+    return nullptr;
+  }
+  // the header sizes everything below, it is checked against what the
+  // constructor builds and the level 0 links against the file size
+  int64_t size = header.size;
+  if (header.m < 2 || header.m > HNSW_MAX_M || header.m0 != header.m * 2 ||
+      header.max_level < (size > 0 ? 0 : -1) ||
+      header.max_level > HNSW_MAX_LEVEL || header.entry < 0 ||
+      (size > 0 && header.entry >= size) ||
+      uint64_t(size) * (sizeof(int) + sizeof(uint32_t) * (header.m0 + 1)) >
+          file_size - sizeof(header)) {
+    return nullptr;
+  }
+  index->m_m = header.m;
+  index->m_m0 = header.m0;
+  index->m_max_level = header.max_level;
+  index->m_entry = header.entry;
+  index->m_levels.resize(size);
+  index->m_links0.resize(size * (header.m0 + 1));
+  index->m_links.resize(size);
+  reader.read((char *)index->m_levels.data(), sizeof(int) * size);
+  reader.read((char *)index->m_links0.data(),
+              sizeof(uint32_t) * index->m_links0.size());
+  for (int64_t i = 0; i < size && reader; i++) {
+    int level = index->m_levels[i];
+    if (level < 0 || level > header.max_level ||
+        !valid_links(&index->m_links0[i * (header.m0 + 1)], header.m0,
+                     size)) {
+      return nullptr;
+    }
+    auto &l = index->m_links[i];
+    l.resize(level * (header.m + 1));
+    reader.read((char *)l.data(), sizeof(uint32_t) * l.size());
+    for (int j = 0; reader && j < level; j++) {
+      if (!valid_links(&l[j * (header.m + 1)], header.m, size)) {
+        return nullptr;
+      }
+    }
+  }
+  if (!reader ||
+      (size > 0 && index->m_levels[header.entry] != header.max_level)) {
+    return nullptr;
+  }
+  // the mtime tells the index files in use from the stale ones to prune
+  std::filesystem::last_write_time(
+      path, std::filesystem::file_time_type::clock::now(), error);
+  return index;
+}
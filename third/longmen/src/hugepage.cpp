@@ -0,0 +1,120 @@
+#include "hugepage.h"
+
+#include "longmen.h"
+#include <cctype>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <sys/mman.h>
+
+namespace {
+
+std::mutex g_mutex;
+// start -> length of the live mappings
+std::map<uintptr_t, size_t> g_regions;
+
+size_t round_up(size_t bytes, size_t align) {
+  return (bytes + align - 1) / align * align;
+}
+
+} // namespace
+
+void *page_alloc(size_t bytes, int policy) {
+  size_t len = round_up(bytes == 0 ? 1 : bytes, 4096);
+  void *ptr = MAP_FAILED;
+#ifdef MAP_HUGETLB
+  if (policy == LONGMEN_HUGEPAGE_HUGETLB) {
+    size_t huge = round_up(len, HUGEPAGE_SIZE);
+    ptr = mmap(nullptr, huge, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (ptr != MAP_FAILED) {
+      len = huge;
+    }
+  }
+#endif
+  if (ptr == MAP_FAILED) {
+    // no reserved huge pages left, transparent ones are the fallback
+    ptr = mmap(nullptr, len, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+      return nullptr;
+    }
+#ifdef MADV_HUGEPAGE
+    if (policy != LONGMEN_HUGEPAGE_OFF && len >= HUGEPAGE_SIZE) {
+      madvise(ptr, len, MADV_HUGEPAGE);
+    }
+#endif
+  }
+  std::lock_guard<std::mutex> lock(g_mutex);
+  g_regions[uintptr_t(ptr)] = len;
+  return ptr;
+}
+
+void page_free(void *ptr) {
+  if (ptr == nullptr) {
+    return;
+  }
+  size_t len = 0;
+  {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    auto it = g_regions.find(uintptr_t(ptr));
+    if (it == g_regions.end()) {
+      std::cerr << "page_free: unknown pointer" << std::endl;
+      return;
+    }
+    len = it->second;
+    g_regions.erase(it);
+  }
+  munmap(ptr, len);
+}
+
+void hugepage_stats(int64_t *allocated, int64_t *backed) {
+  std::map<uintptr_t, size_t> regions;
+  {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    regions = g_regions;
+  }
+  *allocated = 0;
+  *backed = 0;
+  for (auto &r : regions) {
+    *allocated += r.second;
+  }
+
+  // the kernel may merge a region with its neighbors, so every mapping
+  // overlapping one of the regions is counted
+  std::ifstream smaps("/proc/self/smaps");
+  std::string line;
+  bool inside = false;
+  while (std::getline(smaps, line)) {
+    if (line.empty()) {
+      continue;
+    }
+    // mapping headers start with the lower case hex address range, the
+    // fields of a mapping with their capitalized names
+    if (isxdigit(line[0]) && !isupper(line[0])) {
+      uintptr_t start = 0, end = 0;
+      char dash;
+      std::istringstream header(line);
+      header >> std::hex >> start >> dash >> end;
+      auto it = regions.lower_bound(end);
+      inside = it != regions.begin() &&
+               std::prev(it)->first + std::prev(it)->second > start;
+      continue;
+    }
+    if (!inside) {
+      continue;
+    }
+    std::string key;
+    int64_t kb;
+    std::istringstream field(line);
+    if (field >> key >> kb &&
+        (key == "AnonHugePages:" || key == "Private_Hugetlb:" ||
+         key == "Shared_Hugetlb:")) {
+      *backed += kb << 10;
+    }
+  }
+}
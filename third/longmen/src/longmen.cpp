@@ -1,12 +1,24 @@
 #include "longmen.h"
 
+#include "hugepage.h"
 #include "model.h"
+#include "registry.h"
 #include "stdint.h"
+#include <algorithm>
+#include <memory>
 
 void *longmen_new_model(char *path, int plen, char *key, int klen,
-                        char *toolkit, int tlen, char *model, int mlen) {
+                        char *toolkit, int tlen, char *model, int mlen,
+                        longmen_options_t *options) {
+  longmen_options_t opts = {
+      LONGMEN_KEY_STRING, 0, 0, 0, nullptr, 0, LONGMEN_HUGEPAGE_OFF,
+      LONGMEN_NUMA_OFF, LONGMEN_STORE_FP32, LONGMEN_PRECISION_FP32,
+      LONGMEN_BACKEND_AUTO, 0, LONGMEN_REPLICA_CORE, nullptr, 0, 0, 0};
+  if (options != nullptr) {
+    opts = *options;
+  }
   return new Model({path, size_t(plen)}, {key, size_t(klen)},
-                   {toolkit, size_t(tlen)}, {model, size_t(mlen)});
+                   {toolkit, size_t(tlen)}, {model, size_t(mlen)}, opts);
 }
 
 void longmen_del_model(void *model) {
@@ -24,4 +36,253 @@ void longmen_forward(void *model, char *user_features, int len, void *items,
   }
   Model *m = (Model *)model;
   m->forward(user_features, len, (char **)items, (int64_t *)lens, size, scores);
-}
\ No newline at end of file
+}
+
+void longmen_forward_flat(void *model, char *user_features, int len,
+                          char *items, int32_t *offsets, int size,
+                          float *scores) {
+  if (model == nullptr || user_features == nullptr || len == 0 ||
+      items == nullptr || offsets == nullptr || size == 0 ||
+      scores == nullptr) {
+    return;
+  }
+  Model *m = (Model *)model;
+  m->forward(user_features, len, items, offsets, size, scores);
+}
+
+void longmen_forward_bin(void *model, char *user_features, int len,
+                         char *items, int32_t *offsets, int size,
+                         float *scores) {
+  if (model == nullptr || user_features == nullptr || len == 0 ||
+      items == nullptr || offsets == nullptr || size == 0 ||
+      scores == nullptr) {
+    return;
+  }
+  Model *m = (Model *)model;
+  std::unique_ptr<UserContext> ctx(
+      m->new_user_context(user_features, len, true));
+  if (ctx == nullptr) {
+    std::fill(scores, scores + size, LONGMEN_SCORE_MISSING);
+    return;
+  }
+  m->forward(*ctx, items, offsets, size, scores);
+}
+
+void longmen_forward_u64(void *model, char *user_features, int len,
+                         uint64_t *items, int size, float *scores) {
+  if (model == nullptr || user_features == nullptr || len == 0 ||
+      items == nullptr || size == 0 || scores == nullptr) {
+    return;
+  }
+  Model *m = (Model *)model;
+  m->forward(user_features, len, items, size, scores);
+}
+
+void *longmen_user_ctx_new(void *model, char *user_features, int len) {
+  if (model == nullptr || user_features == nullptr || len == 0) {
+    return nullptr;
+  }
+  Model *m = (Model *)model;
+  return m->new_user_context(user_features, len, false);
+}
+
+void *longmen_user_ctx_new_bin(void *model, char *user_features, int len) {
+  if (model == nullptr || user_features == nullptr || len == 0) {
+    return nullptr;
+  }
+  Model *m = (Model *)model;
+  return m->new_user_context(user_features, len, true);
+}
+
+void longmen_user_ctx_del(void *ctx) {
+  if (ctx == nullptr) {
+    return;
+  }
+  delete (UserContext *)ctx;
+}
+
+void *longmen_user_rows_new(void *ctx) {
+  if (ctx == nullptr) {
+    return nullptr;
+  }
+  UserContext *c = (UserContext *)ctx;
+  return new UserRows{c->m_model->m_toolkit_hash, c->m_rows};
+}
+
+void longmen_user_rows_del(void *rows) {
+  if (rows == nullptr) {
+    return;
+  }
+  delete (UserRows *)rows;
+}
+
+void *longmen_user_ctx_from_rows(void *model, void *rows) {
+  if (model == nullptr || rows == nullptr) {
+    return nullptr;
+  }
+  Model *m = (Model *)model;
+  return m->new_user_context(*(UserRows *)rows);
+}
+
+void *longmen_user_ctx_model(void *ctx) {
+  if (ctx == nullptr) {
+    return nullptr;
+  }
+  return ((UserContext *)ctx)->m_model;
+}
+
+int longmen_key_type(void *model) {
+  if (model == nullptr) {
+    return LONGMEN_KEY_STRING;
+  }
+  return ((Model *)model)->key_type();
+}
+
+int longmen_user_ctx_filter(void *ctx, char *filter, int len) {
+  if (ctx == nullptr || (filter == nullptr && len > 0)) {
+    return -1;
+  }
+  UserContext *c = (UserContext *)ctx;
+  return c->m_model->set_filter(*c, {filter, size_t(len)}) ? 0 : -1;
+}
+
+int longmen_forward_ctx(void *ctx, char *items, int32_t *offsets, int size,
+                        float *scores) {
+  if (ctx == nullptr || items == nullptr || offsets == nullptr || size == 0 ||
+      scores == nullptr) {
+    return 0;
+  }
+  UserContext *c = (UserContext *)ctx;
+  return c->m_model->forward(*c, items, offsets, size, scores);
+}
+
+int longmen_forward_ctx_u64(void *ctx, uint64_t *items, int size,
+                            float *scores) {
+  if (ctx == nullptr || items == nullptr || size == 0 || scores == nullptr) {
+    return 0;
+  }
+  UserContext *c = (UserContext *)ctx;
+  return c->m_model->forward(*c, items, size, scores);
+}
+
+int longmen_retrieve(void *ctx, int k, int64_t *rows, float *scores) {
+  if (ctx == nullptr || k <= 0 || rows == nullptr || scores == nullptr) {
+    return 0;
+  }
+  UserContext *c = (UserContext *)ctx;
+  return c->m_model->retrieve(*c, k, rows, scores);
+}
+
+int64_t longmen_pool_size(void *model) {
+  if (model == nullptr) {
+    return 0;
+  }
+  return ((Model *)model)->pool_size();
+}
+
+int longmen_pool_key(void *model, int64_t row, char *buf, int cap) {
+  if (model == nullptr || buf == nullptr) {
+    return -1;
+  }
+  Model *m = (Model *)model;
+  return m->pool_key(row, buf, cap);
+}
+
+void *longmen_handle_new() { return new ModelHandle(); }
+
+void longmen_handle_del(void *handle) {
+  if (handle == nullptr) {
+    return;
+  }
+  delete (ModelHandle *)handle;
+}
+
+void longmen_handle_publish(void *handle, void *model) {
+  if (handle == nullptr) {
+    return;
+  }
+  ((ModelHandle *)handle)->publish((Model *)model);
+}
+
+void *longmen_handle_user_ctx_new(void *handle, char *user_features,
+                                  int len) {
+  if (handle == nullptr) {
+    return nullptr;
+  }
+  EpochGuard guard;
+  return longmen_user_ctx_new(((ModelHandle *)handle)->get(), user_features,
+                              len);
+}
+
+void *longmen_handle_user_ctx_new_bin(void *handle, char *user_features,
+                                      int len) {
+  if (handle == nullptr) {
+    return nullptr;
+  }
+  EpochGuard guard;
+  return longmen_user_ctx_new_bin(((ModelHandle *)handle)->get(),
+                                  user_features, len);
+}
+
+void *longmen_handle_user_ctx_from_rows(void *handle, void *rows) {
+  if (handle == nullptr) {
+    return nullptr;
+  }
+  EpochGuard guard;
+  return longmen_user_ctx_from_rows(((ModelHandle *)handle)->get(), rows);
+}
+
+int longmen_describe(void *model, char *buf, int cap) {
+  if (model == nullptr || buf == nullptr || cap < 0) {
+    return -1;
+  }
+  Model *m = (Model *)model;
+  std::string desc = m->describe();
+  memcpy(buf, desc.data(), std::min<size_t>(cap, desc.size()));
+  return desc.size();
+}
+
+void longmen_pool_stats(void *model, int64_t *processed, int64_t *capacity,
+                        int64_t *hits, int64_t *misses) {
+  if (model == nullptr || processed == nullptr || capacity == nullptr ||
+      hits == nullptr || misses == nullptr) {
+    return;
+  }
+  ((Model *)model)->pool_stats(processed, capacity, hits, misses);
+}
+
+int longmen_pool_hot(void *model, int k, char *buf, int cap) {
+  if (model == nullptr || buf == nullptr || cap < 0) {
+    return -1;
+  }
+  Model *m = (Model *)model;
+  std::string hot = m->pool_hot(k);
+  memcpy(buf, hot.data(), std::min<size_t>(cap, hot.size()));
+  return hot.size();
+}
+
+void longmen_handle_pool_stats(void *handle, int64_t *processed,
+                               int64_t *capacity, int64_t *hits,
+                               int64_t *misses) {
+  if (handle == nullptr) {
+    return;
+  }
+  EpochGuard guard;
+  longmen_pool_stats(((ModelHandle *)handle)->get(), processed, capacity, hits,
+                     misses);
+}
+
+int longmen_handle_pool_hot(void *handle, int k, char *buf, int cap) {
+  if (handle == nullptr) {
+    return -1;
+  }
+  EpochGuard guard;
+  return longmen_pool_hot(((ModelHandle *)handle)->get(), k, buf, cap);
+}
+
+void longmen_hugepage_stats(int64_t *allocated, int64_t *backed) {
+  if (allocated == nullptr || backed == nullptr) {
+    return;
+  }
+  hugepage_stats(allocated, backed);
+}
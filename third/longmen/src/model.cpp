@@ -1,197 +1,719 @@
 #include "model.h"
 
-typedef unsigned char BitMap;
+#include "digest.h"
+#include <ATen/Parallel.h>
+#include <algorithm>
+#include <cstring>
+#include <future>
+#include <mutex>
+#include <queue>
+#include <sched.h>
+#include <sstream>
 
-BitMap* new_bitmap(int size) {
-    int c_size = (size >> 3) + 1;
-    return (BitMap *)calloc(c_size, sizeof(BitMap));
-}
-void free_bitmap(BitMap *data) {
-    free(data);
+#ifdef LONGMEN_USE_ONNXRUNTIME
+#include "onnx_model.h"
+#endif
+
+// pool rows scored per task by Model::retrieve
+#define RETRIEVE_BLOCK_SIZE 4096
+
+// row of a candidate excluded by the filter, missing ones are -1
+#define ROW_FILTERED -2
+
+namespace {
+
+// point the tensors of dst at the ones of src, a clone of it, so replicas
+// share the weights but not the methods and their executors
+void share_tensors(torch::jit::Module &dst, const torch::jit::Module &src) {
+  for (const auto &attr : src.named_attributes(false)) {
+    if (attr.value.isTensor()) {
+      dst.setattr(attr.name, attr.value);
+    }
+  }
+  for (const auto &child : src.named_children()) {
+    torch::jit::Module sub = dst.attr(child.name).toModule();
+    share_tensors(sub, child.value);
+  }
 }
-void set_bitmap(BitMap *bitMap, int index) {
-    int byteIndex = index >> 3;
-    int offset = index & 7;
-    bitMap[byteIndex] |= (1 << offset);
+
+std::vector<torch::jit::Module> replicate(const torch::jit::Module &module,
+                                          int replicas) {
+  std::vector<torch::jit::Module> modules{module};
+  for (int i = 1; i < replicas; i++) {
+    torch::jit::Module replica = module.clone();
+    share_tensors(replica, module);
+    modules.push_back(replica);
+  }
+  return modules;
 }
-int check_bitmap(BitMap *bitMap, int index) {
-    int byteIndex = index >> 3;
-    int offset = index & 7;
-    return (bitMap[byteIndex] & (1 << offset)) != 0;
+
+// errors of a bf16 run that the fp32 module would not have: an operator
+// without a bf16 kernel, or one mixing bf16 with float32 inputs. any other
+// error, of the request itself, says nothing about bf16
+bool bf16_unsupported(const c10::Error &e) {
+  if (dynamic_cast<const c10::NotImplementedError *>(&e) != nullptr) {
+    return true;
+  }
+  std::string_view what(e.what_without_backtrace());
+  return what.find("BFloat16") != std::string_view::npos;
 }
 
-std::vector<std::string> split(const std::string& str, char delimiter) {
-    std::vector<std::string> tokens;
-    std::string token;
-    std::istringstream tokenStream(str);
+std::atomic<size_t> g_replica_tickets(0);
+thread_local size_t t_replica_ticket = g_replica_tickets++;
+std::atomic<size_t> g_context_shards(0);
+thread_local size_t t_context_shard =
+    g_context_shards++ % MODEL_CONTEXT_SHARDS;
 
-    while (std::getline(tokenStream, token, delimiter)) {
-        tokens.push_back(token);
-    }
+} // namespace
 
-    return tokens;
+TorchModel::TorchModel(std::string_view path, int precision, int replicas,
+                       int replica_policy)
+    : m_bf16(false), m_replica_policy(replica_policy) {
+  torch::jit::Module module;
+  try {
+    c10::InferenceMode guard;
+    module = torch::jit::load(std::string(path));
+    module.eval();
+  } catch (const c10::Error &e) {
+    std::cerr << "loading model from: " << path << " error\n";
+    exit(-1);
+  }
+  m_two_tower = module.find_method("user_tower").has_value() &&
+                module.find_method("item_tower").has_value();
+  m_has_head = m_two_tower && module.find_method("head").has_value();
+
+  c10::InferenceMode guard;
+  this->modules_ = replicate(module, replicas);
+  bool bf16 = cpu_has_bf16();
+  if (precision == LONGMEN_PRECISION_BF16 && !bf16) {
+    std::cerr << "model precision bf16: the cpu has no bf16 instructions, "
+              << "running in fp32" << std::endl;
+  }
+  // without the instructions bf16 is emulated and slower than fp32
+  if (precision != LONGMEN_PRECISION_FP32 && bf16) {
+    // the weights are converted once, the fp32 module is kept to fall
+    // back to if the model does not run in bf16
+    torch::jit::Module bf16_module = module.clone();
+    bf16_module.to(torch::kBFloat16);
+    this->bf16_modules_ = replicate(bf16_module, replicas);
+    m_bf16 = true;
+  }
 }
-Tensor::Tensor(int64_t rows, int64_t cols, int64_t stride, torch::Dtype type)
-    : m_rows(rows), m_cols(cols), m_stride(stride), m_type(type) {
-  m_data = (char *)calloc(m_rows * m_cols, m_stride);
+
+TorchModel::~TorchModel() {}
+
+std::vector<torch::jit::IValue> TorchModel::to_values(Input &input) {
+  std::vector<torch::jit::IValue> values;
+  for (int i = 0; i < input.m_size; i++) {
+    torch::Tensor x =
+        torch::from_blob(input[i]->m_data, {input[i]->m_rows, input[i]->m_cols},
+                         input[i]->m_type);
+    values.push_back(x);
+  }
+  return values;
 }
 
-Tensor::~Tensor() {
-  if (m_data != nullptr) {
-    free(m_data);
-    m_data = nullptr;
+size_t TorchModel::replica() {
+  if (this->modules_.size() == 1) {
+    return 0;
   }
+  if (m_replica_policy == LONGMEN_REPLICA_ROUND_ROBIN) {
+    return t_replica_ticket % this->modules_.size();
+  }
+  int cpu = sched_getcpu();
+  return (cpu < 0 ? t_replica_ticket : size_t(cpu)) % this->modules_.size();
 }
 
-void Tensor::print() {
-  std::cout << "[";
-  for (int64_t i = 0; i < m_rows; i++) {
-    if (i > 0) {
-      std::cout << "\n";
-    }
-    std::cout << "[";
-    for (int64_t j = 0; j < m_cols; j++) {
-      if (j > 0) {
-        std::cout << ",";
+torch::Tensor TorchModel::run(const std::string &method,
+                              std::vector<torch::jit::IValue> values) {
+  c10::InferenceMode guard;
+  size_t r = replica();
+  if (m_bf16) {
+    try {
+      std::vector<torch::jit::IValue> inputs;
+      for (auto &v : values) {
+        if (v.isTensor() && v.toTensor().scalar_type() == torch::kFloat32) {
+          inputs.push_back(v.toTensor().to(torch::kBFloat16));
+        } else {
+          inputs.push_back(v);
+        }
       }
-      if (m_type == torch::kFloat32) {
-        std::cout << ((float *)m_data)[i * m_cols + j];
-      } else {
-        std::cout << ((int64_t *)m_data)[i * m_cols + j];
+      return this->bf16_modules_[r]
+          .get_method(method)(inputs)
+          .toTensor()
+          .to(torch::kFloat32)
+          .contiguous();
+    } catch (const c10::Error &e) {
+      // only an unsupported dtype turns bf16 off for good, the call is
+      // retried in fp32 either way
+      bool latch = bf16_unsupported(e);
+      std::cerr << "bf16 " << method
+                << (latch ? " unsupported, back to fp32: "
+                          : " error, retried in fp32: ")
+                << e.what_without_backtrace() << std::endl;
+      if (latch) {
+        m_bf16 = false;
       }
     }
-    std::cout << "]";
   }
-  std::cout << "]" << std::endl;
+  return this->modules_[r].get_method(method)(values).toTensor().contiguous();
 }
 
-void Tensor::set_row(int64_t row, char *data) {
-  memcpy(&m_data[m_cols * m_stride * row], data, m_cols * m_stride);
+void TorchModel::forward(Input &input, float *result) {
+  torch::Tensor output = run("forward", to_values(input));
+  memcpy(result, output.data_ptr<float>(), sizeof(float) * output.numel());
 }
 
-Input::Input(int size) : m_size(size) {
-  m_tensors = (Tensor **)calloc(m_size, sizeof(Tensor *));
+torch::Tensor TorchModel::user_tower(Input &input) {
+  return run("user_tower", to_values(input));
 }
 
-Input::~Input() {
-  for (int i = 0; i < m_size; i++) {
-    if (m_tensors[i] != nullptr) {
-      delete m_tensors[i];
-      m_tensors[i] = nullptr;
-    }
-  }
-  free(m_tensors);
-  m_tensors = nullptr;
+torch::Tensor TorchModel::item_tower(Input &input) {
+  return run("item_tower", to_values(input));
 }
 
-Tensor *&Input::operator[](int index) { return m_tensors[index]; }
+void TorchModel::head(torch::Tensor user, torch::Tensor item, float *result) {
+  torch::Tensor output = run("head", {user, item});
+  memcpy(result, output.data_ptr<float>(), sizeof(float) * output.numel());
+}
 
-void Input::print() {
-  for (int i = 0; i < m_size; i++) {
-    m_tensors[i]->print();
-    std::cout << std::endl;
+std::string TorchModel::describe() {
+  std::ostringstream out;
+  out << "torchscript" << (m_bf16 ? " bf16" : " fp32") << ", "
+      << this->modules_.size() << " replicas\n";
+  for (auto &method : this->modules_[0].get_methods()) {
+    out << method.function().getSchema() << "\n";
   }
+  return out.str();
 }
 
-TorchModel::TorchModel(std::string_view path) {
-  try {
-    c10::InferenceMode guard;
-    this->module_ = torch::jit::load(std::string(path));
-    this->module_.eval();
-  } catch (const c10::Error &e) {
-    std::cerr << "loading model from: " << path << " error\n";
+UserContext::UserContext(Model *model, luban::SharedFeaturesPtr user_feas)
+    : UserContext(model, model->process_user(user_feas)) {}
+
+UserContext::UserContext(Model *model, std::shared_ptr<luban::Rows> rows)
+    : m_model(model), m_rows(rows) {
+  m_user_tower = model->user_tower(*m_rows);
+  model->m_contexts[t_context_shard].n++;
+}
+
+UserContext::~UserContext() { m_model->m_contexts[t_context_shard].n--; }
+
+static std::shared_ptr<Backend> load_backend(std::string_view path,
+                                             const longmen_options_t &options) {
+  bool onnx = options.backend == LONGMEN_BACKEND_ONNX ||
+              (options.backend == LONGMEN_BACKEND_AUTO && path.size() >= 5 &&
+               path.substr(path.size() - 5) == ".onnx");
+  if (onnx) {
+#ifdef LONGMEN_USE_ONNXRUNTIME
+    return std::make_shared<OnnxModel>(path);
+#else
+    std::cerr << "loading model from: " << path
+              << " error, built without onnxruntime" << std::endl;
     exit(-1);
+#endif
   }
+  return std::make_shared<TorchModel>(path, options.precision,
+                                      options.replicas, options.replica_policy);
 }
 
-TorchModel::~TorchModel() {}
+Model::Model(std::string_view pool, std::string_view key,
+             std::string_view toolkit, std::string_view model,
+             const longmen_options_t &options)
+    : m_toolkit_hash(0), m_ann_ef(options.ann_ef),
+      m_huge_page(options.huge_page) {
+  // the model deserializes and the pool file is hashed, unless the caller
+  // did, while the toolkit loads, then while the pool is processed. only the
+  // pool needs the toolkit, and only the item tower needs both
+  auto backend = std::async(std::launch::async,
+                            [&]() { return load_backend(model, options); });
+  std::future<uint64_t> pool_hash;
+  if (options.pool_hash == 0) {
+    pool_hash = std::async(std::launch::async,
+                           [&]() { return hash_file(pool); });
+  }
+  m_toolkit_hash = hash_file(toolkit);
+  m_toolkit = std::make_shared<luban::Toolkit>(std::string(toolkit));
+  for (size_t i = 0; i < m_toolkit->m_groups.size(); i++) {
+    m_group_pos[m_toolkit->m_groups[i].id] = i;
+  }
+  m_placed.assign(m_toolkit->m_groups.size(), false);
+  for (auto *placer : {m_toolkit->m_user_placer.get(),
+                       m_toolkit->m_item_placer.get()}) {
+    for (auto &group : placer->m_groups) {
+      m_placed[m_group_pos[group.id]] = true;
+    }
+  }
+  uint64_t hash = options.pool_hash != 0 ? options.pool_hash : pool_hash.get();
+  std::string share_key = Pool::share_key(hash, m_toolkit_hash, options);
+  std::shared_ptr<Pool> shared = Pool::find_shared(share_key);
+  std::shared_ptr<Pool> own;
+  if (shared == nullptr) {
+    own = std::make_shared<Pool>(pool, hash, m_toolkit, m_toolkit_hash,
+                                 options);
+  }
+  m_model = backend.get();
 
-void TorchModel::forward(Input &input, float *result) {
-  c10::InferenceMode guard;
-  std::vector<torch::jit::IValue> values;
-  for (int i = 0; i < input.m_size; i++) {
-    torch::Tensor x =
-        torch::from_blob(input[i]->m_data, {input[i]->m_rows, input[i]->m_cols},
-                         input[i]->m_type);
-    values.push_back(x);
+  if (!m_model->m_two_tower) {
+    m_pool = shared != nullptr ? shared : Pool::share(share_key, own);
+    return;
+  }
+  // the item tower of the model is stored in the pool
+  m_pool = own != nullptr ? own
+                          : std::make_shared<Pool>(pool, hash, m_toolkit,
+                                                   m_toolkit_hash, options);
+  build_item_tower();
+  if (options.ann_m > 0) {
+    build_index(pool, options);
   }
-  torch::Tensor output = this->module_.forward(values).toTensor();
-  auto accessor = output.accessor<float, 2>();
-  memcpy(result, accessor.data(), sizeof(float) * output.numel());
 }
 
-Model::Model(std::string_view pool, std::string_view key,
-             std::string_view toolkit, std::string_view model)
-    : m_toolkit(std::make_shared<luban::Toolkit>(std::string(toolkit))),
-      m_model(std::make_shared<TorchModel>(model)) {
-  std::ifstream reader(std::string(pool), std::ios::in);
-  if (!reader) {
-    std::cerr << "read pool data file: " << pool << " error" << std::endl;
-    exit(-1);
+void Model::build_index(std::string_view pool,
+                        const longmen_options_t &options) {
+  // models sharing a pool keep their own index, named by the item tower
+  // outputs it was built from
+  uint64_t fingerprint = HNSW::fingerprint(*m_pool);
+  char name[32];
+  snprintf(name, sizeof(name), ".%016llx.hnsw",
+           (unsigned long long)fingerprint);
+  std::string path = std::string(pool) + name;
+  m_index = HNSW::load(path, *m_pool, fingerprint);
+  if (m_index != nullptr) {
+    return;
   }
-  std::string line;
-  std::string m_key(key);
-  while (std::getline(reader, line)) {
-    auto ss = split(line,'\t');
-    if (ss.size() != 2) {
-      continue;
+  m_index = std::make_shared<HNSW>(*m_pool, options.ann_m,
+                                   options.ann_ef_construction);
+  m_index->save(path, fingerprint);
+}
+
+int64_t Model::contexts() const {
+  // after the epochs of a publish, shards only go down: a context alive
+  // through the loop is counted in a shard read before its decrement
+  int64_t n = 0;
+  for (auto &c : m_contexts) {
+    n += c.n.load();
+  }
+  return n;
+}
+
+Tensor *Model::new_tensor(int id, int64_t rows) {
+  size_t pos = m_group_pos[id];
+  auto &group = m_toolkit->m_groups[pos];
+  Tensor *tensor = new Tensor(rows, group.width, group.stride,
+                              group.type == luban::DataType::kFloat32
+                                  ? torch::kFloat32
+                                  : torch::kInt64,
+                              m_huge_page);
+  if (!m_placed[pos]) {
+    // no placer writes the group, the recycled buffer would feed the model
+    // what the previous call left in it
+    memset(tensor->m_data, 0, rows * group.width * group.stride);
+  }
+  return tensor;
+}
+
+void Model::build_item_tower() {
+  // item features are static between pool versions, so the item tower
+  // runs once here over the whole pool, in batches
+  const int64_t batch = 4096;
+  auto &item_groups = m_toolkit->m_item_placer->m_groups;
+  for (int64_t start = 0; start < m_pool->m_size; start += batch) {
+    int64_t n = std::min(batch, m_pool->m_size - start);
+    Input input(item_groups.size());
+    for (size_t j = 0; j < item_groups.size(); j++) {
+      input[j] = new_tensor(item_groups[j].id, n);
     }
-    auto item_id = ss[0];
-    luban::SharedFeaturesPtr features = std::make_shared<luban::Features>(ss[1]);
-    m_pool[item_id] = m_toolkit->process_item(features);
+    // one lookup per item, a lazy pool processes it on the first
+    for (int64_t i = 0; i < n; i++) {
+      auto item = m_pool->fetch(start + i);
+      for (size_t j = 0; j < item_groups.size(); j++) {
+        m_pool->gather(item, j, input[j]->row(i));
+      }
+    }
+    torch::Tensor output = m_model->item_tower(input);
+    if (start == 0) {
+      m_pool->alloc_tower(output.numel() / n);
+    }
+    float *data = output.data_ptr<float>();
+    for (int64_t i = 0; i < n; i++) {
+      memcpy(m_pool->tower(start + i), data + i * m_pool->m_tower_dim,
+             sizeof(float) * m_pool->m_tower_dim);
+    }
+  }
+  m_pool->replicate_tower();
+}
 
+torch::Tensor Model::user_tower(luban::Rows &user_rows) {
+  if (!m_model->m_two_tower) {
+    return {};
   }
-  reader.close();
+  auto &user_groups = m_toolkit->m_user_placer->m_groups;
+  Input input(user_groups.size());
+  for (size_t j = 0; j < user_groups.size(); j++) {
+    input[j] = new_tensor(user_groups[j].id, 1);
+    input[j]->set_row(0, user_rows[user_groups[j].index]->m_data);
+  }
+  // the output may be a view of an input, whose buffer goes back to the
+  // tensor cache when `input` is released, and the context keeps it
+  return m_model->user_tower(input).clone();
 }
 
 void Model::forward(char *user_features, size_t len, char **items,
                     int64_t *lens, int size, float *scores) {
-  auto user_feas =
-      std::make_shared<luban::Features>(std::string_view{user_features, len});
+  UserContext ctx(this, parse_features(user_features, len));
+  // resolve all the candidates first, so the pool misses overlap
+  std::vector<int64_t> rows(size);
+  m_pool->lookup(items, lens, size, rows.data());
+  forward_rows(ctx, rows.data(), size, scores);
+}
+
+void Model::forward(char *user_features, size_t len, char *items,
+                    int32_t *offsets, int size, float *scores) {
+  UserContext ctx(this, parse_features(user_features, len));
+  forward(ctx, items, offsets, size, scores);
+}
+
+void Model::forward(char *user_features, size_t len, uint64_t *items,
+                    int size, float *scores) {
+  UserContext ctx(this, parse_features(user_features, len));
+  forward(ctx, items, size, scores);
+}
+
+int Model::forward(UserContext &ctx, char *items, int32_t *offsets, int size,
+                   float *scores) {
+  std::vector<int64_t> rows(size);
+  m_pool->lookup(items, offsets, size, rows.data());
+  apply_filter(ctx, rows.data(), size);
+  return forward_rows(ctx, rows.data(), size, scores);
+}
+
+int Model::forward(UserContext &ctx, uint64_t *items, int size,
+                   float *scores) {
+  std::vector<int64_t> rows(size);
+  m_pool->lookup(items, size, rows.data());
+  apply_filter(ctx, rows.data(), size);
+  return forward_rows(ctx, rows.data(), size, scores);
+}
+
+bool Model::set_filter(UserContext &ctx, std::string_view expr) {
+  ctx.m_filter.reset();
+  auto filter = std::make_unique<Filter>(m_pool->m_attributes, expr);
+  if (!filter->m_valid) {
+    return false;
+  }
+  ctx.m_filter = std::move(filter);
+  return true;
+}
+
+void Model::apply_filter(UserContext &ctx, int64_t *rows, int size) {
+  if (ctx.m_filter == nullptr) {
+    return;
+  }
+  for (int i = 0; i < size; i++) {
+    if (rows[i] >= 0 && !ctx.m_filter->check(rows[i])) {
+      rows[i] = ROW_FILTERED;
+    }
+  }
+}
+
+UserContext *Model::new_user_context(char *user_features, size_t len,
+                                     bool bin) {
+  if (!bin) {
+    return new UserContext(this, parse_features(user_features, len));
+  }
+  auto user_feas = decode_features(user_features, len);
+  if (user_feas == nullptr) {
+    std::cerr << "decode binary user features error" << std::endl;
+    return nullptr;
+  }
+  return new UserContext(this, user_feas);
+}
 
+UserContext *Model::new_user_context(const UserRows &rows) {
+  if (rows.m_toolkit_hash != m_toolkit_hash || rows.m_rows == nullptr) {
+    return nullptr;
+  }
+  return new UserContext(this, rows.m_rows);
+}
+
+std::shared_ptr<luban::Rows>
+Model::process_user(luban::SharedFeaturesPtr user_feas) {
   // luban to process user features
-  auto user_rows = m_toolkit->process_user(user_feas);
+  return m_toolkit->process_user(user_feas);
+}
+
+void Model::score_towers(UserContext &ctx, int64_t start, int64_t n,
+                         float *scores) {
+  // also runs on the intra-op threads of at::parallel_for
+  c10::InferenceMode guard;
+  int64_t dim = m_pool->m_tower_dim;
+  int64_t stride = m_pool->m_tower_stride;
+  if (m_model->m_has_head) {
+    torch::Tensor item = torch::from_blob(m_pool->tower(start), {n, dim},
+                                          {stride, 1}, torch::kFloat32);
+    torch::Tensor user = ctx.m_user_tower.expand({n, ctx.m_user_tower.size(1)});
+    m_model->head(user, item, scores);
+    return;
+  }
+  const float *user = padded_user(ctx);
+  for (int64_t i = 0; i < n; i++) {
+    scores[i] = dot(user, m_pool->tower(start + i), stride);
+  }
+}
+
+const float *Model::padded_user(UserContext &ctx) {
+  // the user vector is padded like the pool rows, whose padding is zero
+  thread_local std::vector<float> user;
+  user.assign(m_pool->m_tower_stride, 0.0f);
+  memcpy(user.data(), ctx.m_user_tower.data_ptr<float>(),
+         sizeof(float) *
+             std::min(m_pool->m_tower_dim, ctx.m_user_tower.numel()));
+  return user.data();
+}
+
+int Model::search_index(UserContext &ctx, int k, int64_t *rows,
+                        float *scores) {
+  std::vector<std::pair<float, int64_t>> result;
+  int ef = std::max(m_ann_ef, k);
+  if (!m_model->m_has_head && ctx.m_filter == nullptr) {
+    m_index->search(padded_user(ctx), k, ef, result);
+  } else {
+    // the graph is walked by inner product, then every candidate it
+    // reaches is filtered and rescored by the head
+    m_index->search(padded_user(ctx), ef, ef, result);
+    if (ctx.m_filter != nullptr) {
+      result.erase(std::remove_if(result.begin(), result.end(),
+                                  [&](auto &r) {
+                                    return !ctx.m_filter->check(r.second);
+                                  }),
+                   result.end());
+    }
+  }
+  if (m_model->m_has_head && !result.empty()) {
+    int64_t n = result.size();
+    int64_t dim = m_pool->m_tower_dim;
+    c10::InferenceMode guard;
+    torch::Tensor item = torch::empty({n, dim}, torch::kFloat32);
+    float *data = item.data_ptr<float>();
+    for (int64_t i = 0; i < n; i++) {
+      memcpy(data + i * dim, m_pool->tower(result[i].second),
+             sizeof(float) * dim);
+    }
+    std::vector<float> head(n);
+    m_model->head(ctx.m_user_tower.expand({n, ctx.m_user_tower.size(1)}), item,
+                  head.data());
+    for (int64_t i = 0; i < n; i++) {
+      result[i].first = head[i];
+    }
+    std::sort(result.begin(), result.end(), std::greater<>());
+  }
+  int count = std::min<int>(k, result.size());
+  for (int i = 0; i < count; i++) {
+    scores[i] = result[i].first;
+    rows[i] = result[i].second;
+  }
+  return count;
+}
+
+int Model::retrieve(UserContext &ctx, int k, int64_t *rows, float *scores) {
+  if (!m_model->m_two_tower || k <= 0 || m_pool->m_size == 0) {
+    return 0;
+  }
+  // the heaps and the search width grow with k, which comes from requests
+  k = int(std::min<int64_t>(k, m_pool->m_size));
+  refresh_node();
+  if (m_index != nullptr) {
+    return search_index(ctx, k, rows, scores);
+  }
+  using Entry = std::pair<float, int64_t>;
+  using Heap =
+      std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>>;
+  auto push = [k](Heap &heap, const Entry &entry) {
+    if (int(heap.size()) < k) {
+      heap.push(entry);
+    } else if (entry.first > heap.top().first) {
+      heap.pop();
+      heap.push(entry);
+    }
+  };
+
+  Heap top;
+  std::mutex mutex;
+  int64_t size = m_pool->m_size;
+  int64_t blocks = (size + RETRIEVE_BLOCK_SIZE - 1) / RETRIEVE_BLOCK_SIZE;
+  at::parallel_for(0, blocks, 1, [&](int64_t begin, int64_t end) {
+    // every task keeps its own heap and merges it once at the end
+    refresh_node();
+    Heap heap;
+    std::vector<float> buffer(RETRIEVE_BLOCK_SIZE);
+    for (int64_t b = begin; b < end; b++) {
+      int64_t start = b * RETRIEVE_BLOCK_SIZE;
+      int64_t n = std::min<int64_t>(RETRIEVE_BLOCK_SIZE, size - start);
+      score_towers(ctx, start, n, buffer.data());
+      for (int64_t i = 0; i < n; i++) {
+        if (ctx.m_filter == nullptr || ctx.m_filter->check(start + i)) {
+          push(heap, {buffer[i], start + i});
+        }
+      }
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    while (!heap.empty()) {
+      push(top, heap.top());
+      heap.pop();
+    }
+  });
+
+  int count = top.size();
+  for (int i = count - 1; i >= 0; i--) {
+    scores[i] = top.top().first;
+    rows[i] = top.top().second;
+    top.pop();
+  }
+  return count;
+}
+
+int Model::pool_key(int64_t row, char *buf, int cap) {
+  return m_pool->key(row, buf, cap);
+}
+
+int Model::key_type() const { return m_pool->m_key_type; }
+
+int64_t Model::pool_size() const { return m_pool->m_size; }
+
+void Model::pool_stats(int64_t *processed, int64_t *capacity, int64_t *hits,
+                       int64_t *misses) {
+  RowCache *cache = m_pool->row_cache();
+  *processed = cache == nullptr ? 0 : cache->size();
+  *capacity = cache == nullptr ? 0 : cache->m_capacity;
+  *hits = cache == nullptr ? 0 : cache->hits();
+  *misses = cache == nullptr ? 0 : cache->misses();
+}
+
+std::string Model::pool_hot(int k) {
+  RowCache *cache = m_pool->row_cache();
+  if (cache == nullptr) {
+    return "";
+  }
+  std::ostringstream out;
+  char key[256];
+  for (auto &row : cache->hot(k)) {
+    int len = m_pool->key(row.first, key, sizeof(key));
+    if (len >= 0) {
+      out << std::string_view(key, len) << "\t" << row.second << "\n";
+    }
+  }
+  return out.str();
+}
+
+std::string Model::describe() { return m_model->describe(); }
+
+void Model::forward_towers(UserContext &ctx, int64_t *rows, int size,
+                           float *scores) {
+  int64_t dim = m_pool->m_tower_dim;
+  torch::Tensor item = torch::empty({size, dim}, torch::kFloat32);
+  float *data = item.data_ptr<float>();
+  for (int i = 0; i < size; i++) {
+    memcpy(data + i * dim, m_pool->tower(rows[i]), sizeof(float) * dim);
+  }
+  if (m_model->m_has_head) {
+    torch::Tensor user =
+        ctx.m_user_tower.expand({size, ctx.m_user_tower.size(1)});
+    m_model->head(user, item, scores);
+  } else {
+    float *user = ctx.m_user_tower.data_ptr<float>();
+    for (int i = 0; i < size; i++) {
+      scores[i] = dot(user, data + i * dim, dim);
+    }
+  }
+}
+
+void Model::forward_items(UserContext &ctx, int64_t *rows, int size,
+                          float *scores) {
+  auto &user_rows = ctx.m_rows;
 
   Input input(m_toolkit->m_groups.size());
 
   for (auto &group : m_toolkit->m_groups) {
-    if (group.type == luban::DataType::kFloat32) {
-      input[group.id] =
-          new Tensor(size, group.width, group.stride, torch::kFloat32);
-    } else {
-      input[group.id] =
-          new Tensor(size, group.width, group.stride, torch::kInt64);
-    }
+    input[group.id] = new_tensor(group.id, size);
   }
 
   char *data = nullptr;
-  BitMap* not_found_bitmap = new_bitmap(size);
-  for (size_t i = 0; i < size; i++) {
+  auto &item_groups = m_toolkit->m_item_placer->m_groups;
+  // the rows prefetched by the lookup are usually evicted by now in large
+  // batches, they are loaded again ahead of the gather
+  for (int i = 0; i < size && i < POOL_PREFETCH_DISTANCE; i++) {
+    m_pool->prefetch_row(rows[i]);
+  }
+  for (int i = 0; i < size; i++) {
+    if (i + POOL_PREFETCH_DISTANCE < size) {
+      m_pool->prefetch_row(rows[i + POOL_PREFETCH_DISTANCE]);
+    }
     // copy user processed features
     for (auto &group : m_toolkit->m_user_placer->m_groups) {
       data = (*user_rows)[group.index]->m_data;
       input[group.id]->set_row(i, data);
     }
 
-    // get item processed features
-    auto iter = m_pool.find(std::string{items[i], size_t(lens[i])});
-    if (iter == m_pool.end()) {
-      set_bitmap(not_found_bitmap, i);
+    // get item processed features, processed here first in a lazy pool
+    auto item = m_pool->fetch(rows[i]);
+    for (size_t j = 0; j < item_groups.size(); j++) {
+      m_pool->gather(item, j, input[item_groups[j].id]->row(i));
+    }
+  }
+
+  m_model->forward(input, scores);
+}
+
+int Model::forward_rows(UserContext &ctx, int64_t *rows, int size,
+                        float *scores) {
+  refresh_node();
+  // only the candidates found in the pool and kept by the filter are
+  // assembled and inferred. recall sources are merged upstream, so the same
+  // row often shows up several times: a small open addressing table over
+  // the row ids infers every row once and fans its score out
+  uint64_t capacity = 16;
+  while (capacity < uint64_t(size) * 2) {
+    capacity <<= 1;
+  }
+  uint64_t mask = capacity - 1;
+  std::vector<int64_t> table(capacity, -1);
+  std::vector<int64_t> unique;
+  std::vector<int> pos(size, -1);
+  unique.reserve(size);
+  int duplicates = 0;
+  for (int i = 0; i < size; i++) {
+    if (rows[i] < 0) {
       continue;
     }
+    uint64_t slot = (uint64_t(rows[i]) * 0x9e3779b97f4a7c15ULL >> 32) & mask;
+    while (table[slot] >= 0 && unique[table[slot]] != rows[i]) {
+      slot = (slot + 1) & mask;
+    }
+    if (table[slot] < 0) {
+      table[slot] = unique.size();
+      unique.push_back(rows[i]);
+    } else {
+      duplicates++;
+    }
+    pos[i] = table[slot];
+  }
 
-    for (auto &group : m_toolkit->m_item_placer->m_groups) {
-      data = iter->second->m_rows[group.index]->m_data;
-      input[group.id]->set_row(i, data);
+  std::vector<float> unique_scores(unique.size());
+  if (!unique.empty()) {
+    if (m_model->m_two_tower) {
+      forward_towers(ctx, unique.data(), unique.size(), unique_scores.data());
+    } else {
+      forward_items(ctx, unique.data(), unique.size(), unique_scores.data());
     }
   }
-  
-  m_model->forward(input, scores);
 
-  for (int i=0; i< size; i++) {
-    if (check_bitmap(not_found_bitmap,i)) {
-        scores[i] = -1.0;
+  for (int i = 0; i < size; i++) {
+    if (pos[i] >= 0) {
+      scores[i] = unique_scores[pos[i]];
+    } else if (rows[i] == ROW_FILTERED) {
+      scores[i] = LONGMEN_SCORE_FILTERED;
+    } else {
+      scores[i] = LONGMEN_SCORE_MISSING;
     }
   }
-  free_bitmap(not_found_bitmap);
-}
\ No newline at end of file
+  return duplicates;
+}
@@ -0,0 +1,106 @@
+#include "onnx_model.h"
+
+#include "longmen.h"
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+
+static Ort::Session load_session(Ort::Env &env, std::string_view path) {
+  try {
+    Ort::SessionOptions options;
+    // the calls are already spread over the torch thread pool
+    options.SetIntraOpNumThreads(1);
+    options.SetGraphOptimizationLevel(GraphOptimizationLevel::ORT_ENABLE_ALL);
+    return Ort::Session(env, std::string(path).c_str(), options);
+  } catch (const Ort::Exception &e) {
+    std::cerr << "loading model from: " << path << " error: " << e.what()
+              << std::endl;
+    exit(-1);
+  }
+}
+
+OnnxModel::OnnxModel(std::string_view path)
+    : m_env(ORT_LOGGING_LEVEL_WARNING, "longmen"),
+      m_session(load_session(m_env, path)) {
+  Ort::AllocatorWithDefaultOptions allocator;
+  for (size_t i = 0; i < m_session.GetInputCount(); i++) {
+    m_inputs.push_back(m_session.GetInputNameAllocated(i, allocator).get());
+  }
+  for (size_t i = 0; i < m_session.GetOutputCount(); i++) {
+    m_outputs.push_back(m_session.GetOutputNameAllocated(i, allocator).get());
+  }
+  if (m_outputs.empty()) {
+    std::cerr << "loading model from: " << path << " error, no outputs"
+              << std::endl;
+    exit(-1);
+  }
+}
+
+void OnnxModel::forward(Input &inputs, float *result) {
+  if (inputs.m_size <= 0) {
+    return;
+  }
+  int64_t rows = inputs[0]->m_rows;
+  if (size_t(inputs.m_size) != m_inputs.size()) {
+    std::cerr << "onnx model wants " << m_inputs.size() << " inputs, got "
+              << inputs.m_size << std::endl;
+    std::fill(result, result + rows, LONGMEN_SCORE_MISSING);
+    return;
+  }
+
+  auto memory = Ort::MemoryInfo::CreateCpu(OrtArenaAllocator, OrtMemTypeCPU);
+  std::vector<Ort::Value> values;
+  std::vector<const char *> input_names, output_names{m_outputs[0].c_str()};
+  for (int i = 0; i < inputs.m_size; i++) {
+    Tensor *t = inputs[i];
+    std::array<int64_t, 2> shape{t->m_rows, t->m_cols};
+    size_t count = t->m_rows * t->m_cols;
+    if (t->m_type == torch::kFloat32) {
+      values.push_back(Ort::Value::CreateTensor<float>(
+          memory, (float *)t->m_data, count, shape.data(), shape.size()));
+    } else {
+      values.push_back(Ort::Value::CreateTensor<int64_t>(
+          memory, (int64_t *)t->m_data, count, shape.data(), shape.size()));
+    }
+    input_names.push_back(m_inputs[i].c_str());
+  }
+
+  try {
+    auto outputs =
+        m_session.Run(Ort::RunOptions{nullptr}, input_names.data(),
+                      values.data(), values.size(), output_names.data(), 1);
+    float *scores = outputs[0].GetTensorMutableData<float>();
+    size_t count = outputs[0].GetTensorTypeAndShapeInfo().GetElementCount();
+    size_t n = std::min<size_t>(count, rows);
+    memcpy(result, scores, n * sizeof(float));
+    std::fill(result + n, result + rows, LONGMEN_SCORE_MISSING);
+  } catch (const Ort::Exception &e) {
+    std::cerr << "onnx forward error: " << e.what() << std::endl;
+    std::fill(result, result + rows, LONGMEN_SCORE_MISSING);
+  }
+}
+
+std::string OnnxModel::describe() {
+  std::ostringstream out;
+  out << "onnx\n";
+  auto shape = [&](Ort::TypeInfo info) {
+    auto tensor = info.GetTensorTypeAndShapeInfo();
+    out << "(type " << tensor.GetElementType() << ", shape [";
+    auto dims = tensor.GetShape();
+    for (size_t i = 0; i < dims.size(); i++) {
+      out << (i ? ", " : "") << dims[i];
+    }
+    out << "])\n";
+  };
+  for (size_t i = 0; i < m_inputs.size(); i++) {
+    out << "input " << m_inputs[i] << " ";
+    shape(m_session.GetInputTypeInfo(i));
+  }
+  for (size_t i = 0; i < m_outputs.size(); i++) {
+    out << "output " << m_outputs[i] << " ";
+    shape(m_session.GetOutputTypeInfo(i));
+  }
+  return out.str();
+}
@@ -0,0 +1,904 @@
+#include "pool.h"
+
+#include "digest.h"
+#include "hugepage.h"
+#include <algorithm>
+#include <charconv>
+#include <cstdio>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <fcntl.h>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <variant>
+
+std::vector<std::string> split(const std::string &str, char delimiter) {
+  std::vector<std::string> tokens;
+  std::string token;
+  std::istringstream tokenStream(str);
+
+  while (std::getline(tokenStream, token, delimiter)) {
+    tokens.push_back(token);
+  }
+
+  return tokens;
+}
+
+static inline uint64_t hash_key(std::string_view key) {
+  return std::hash<std::string_view>{}(key);
+}
+
+static inline uint64_t hash_key(uint64_t key) {
+  // splitmix64 finalizer, item ids are often sequential
+  key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  key = (key ^ (key >> 27)) * 0x94d049bb133111ebULL;
+  return key ^ (key >> 31);
+}
+
+static inline uint16_t to_half(float value) {
+  // round to nearest even, out of range values become infinity
+  uint32_t x;
+  memcpy(&x, &value, sizeof(x));
+  uint32_t sign = (x >> 16) & 0x8000;
+  int32_t exp = int32_t((x >> 23) & 0xff) - 127 + 15;
+  uint32_t mant = x & 0x7fffff;
+  if (((x >> 23) & 0xff) == 0xff) {
+    return sign | 0x7c00 | (mant != 0 ? 0x200 : 0);
+  }
+  if (exp >= 0x1f) {
+    return sign | 0x7c00;
+  }
+  int shift = 13;
+  uint32_t half = (uint32_t(exp) << 10) | (mant >> 13);
+  if (exp <= 0) {
+    if (exp < -10) {
+      return sign;
+    }
+    mant |= 0x800000;
+    shift = 14 - exp;
+    half = mant >> shift;
+  }
+  uint32_t rem = mant & ((1u << shift) - 1);
+  uint32_t mid = 1u << (shift - 1);
+  if (rem > mid || (rem == mid && (half & 1))) {
+    // may carry into the exponent, which is still right
+    half++;
+  }
+  return sign | half;
+}
+
+static inline float from_half(uint16_t h) {
+  // moving the exponent and mantissa bits into place and scaling by 2^112
+  // rebiases the exponent, for subnormals too. branch free so it vectorizes
+  uint32_t em = h & 0x7fff;
+  uint32_t bits = em << 13;
+  float value;
+  memcpy(&value, &bits, sizeof(bits));
+  value *= 0x1p112f;
+  memcpy(&bits, &value, sizeof(bits));
+  bits = em >= 0x7c00 ? 0x7f800000 | (em << 13) : bits;
+  bits |= uint32_t(h & 0x8000) << 16;
+  memcpy(&value, &bits, sizeof(bits));
+  return value;
+}
+
+static inline uint16_t to_bf16(float value) {
+  uint32_t x;
+  memcpy(&x, &value, sizeof(x));
+  if ((x & 0x7fffffff) > 0x7f800000) {
+    return (x >> 16) | 0x40;
+  }
+  return (x + 0x7fff + ((x >> 16) & 1)) >> 16;
+}
+
+static inline float from_bf16(uint16_t h) {
+  uint32_t bits = uint32_t(h) << 16;
+  float value;
+  memcpy(&value, &bits, sizeof(bits));
+  return value;
+}
+
+static inline int64_t stored_bytes(int64_t floats, int64_t bytes, int store) {
+  switch (store) {
+  case LONGMEN_STORE_FP16:
+  case LONGMEN_STORE_BF16:
+    return floats * sizeof(uint16_t);
+  case LONGMEN_STORE_INT8:
+    return sizeof(float) + floats;
+  default:
+    return bytes;
+  }
+}
+
+static inline bool parse_key(std::string_view key, uint64_t &value) {
+  auto ret = std::from_chars(key.data(), key.data() + key.size(), value);
+  return ret.ec == std::errc() && ret.ptr == key.data() + key.size();
+}
+
+// lines of the file, an upper bound of the items it holds
+static int64_t count_lines(std::string_view path) {
+  std::ifstream reader(std::string(path), std::ios::in | std::ios::binary);
+  char buf[1 << 16];
+  int64_t lines = 0;
+  bool partial = false;
+  while (reader.read(buf, sizeof(buf)) || reader.gcount() > 0) {
+    char *end = buf + reader.gcount();
+    lines += std::count(buf, end, '\n');
+    partial = end[-1] != '\n';
+  }
+  return lines + (partial ? 1 : 0);
+}
+
+Pool::Pool(std::string_view path, uint64_t pool_hash,
+           std::shared_ptr<luban::Toolkit> toolkit, uint64_t toolkit_hash,
+           const longmen_options_t &options)
+    : m_key_type(options.key_type), m_numa(options.numa),
+      m_huge_page(options.huge_page), m_size(0),
+      m_row_bytes(0), m_tower_dim(0), m_tower_stride(0), m_capacity(0),
+      m_data(nullptr), m_mask(0), m_tower(nullptr), m_map(nullptr),
+      m_map_bytes(0) {
+  std::unordered_map<int, luban::GroupConfig> configs;
+  for (auto &group : toolkit->m_groups) {
+    configs[group.id] = group;
+  }
+  for (auto &group : toolkit->m_item_placer->m_groups) {
+    auto &config = configs[group.id];
+    Group g{m_row_bytes, config.width * config.stride, 0, LONGMEN_STORE_FP32};
+    if (config.type == luban::DataType::kFloat32 &&
+        config.stride == sizeof(float)) {
+      g.floats = config.width;
+      g.store = options.float_store;
+    }
+    m_indexes.push_back(group.index);
+    m_groups.push_back(g);
+    m_row_bytes += stored_bytes(g.floats, g.bytes, g.store);
+  }
+  if (options.attributes != nullptr && options.attributes_len > 0) {
+    for (auto &name : split({options.attributes, size_t(options.attributes_len)},
+                            ',')) {
+      if (!name.empty()) {
+        m_attributes[name];
+      }
+    }
+  }
+
+  if (options.lazy_rows > 0) {
+    // processed on lookup, there are no rows to place or to cache
+    m_toolkit = toolkit;
+    m_cache = std::make_unique<RowCache>(options.lazy_rows);
+    map(path);
+    build_index();
+    return;
+  }
+
+  std::string cache;
+  if (options.cache_dir != nullptr && options.cache_dir_len > 0) {
+    // the layout of the rows follows from the toolkit and the store
+    std::string attributes =
+        options.attributes == nullptr
+            ? ""
+            : std::string(options.attributes, options.attributes_len);
+    char name[96];
+    snprintf(name, sizeof(name), "pool-%016llx-%016llx-%d-%d-%016llx.cache",
+             (unsigned long long)pool_hash, (unsigned long long)toolkit_hash,
+             options.key_type, options.float_store,
+             (unsigned long long)hash_bytes(attributes.data(),
+                                            attributes.size(), 0));
+    cache = (std::filesystem::path(std::string(options.cache_dir,
+                                               options.cache_dir_len)) /
+             name)
+                .string();
+  }
+  if (cache.empty() || !load_cache(cache)) {
+    process(path, *toolkit);
+    if (!cache.empty()) {
+      save_cache(cache);
+    }
+  }
+  replicate_rows();
+  build_index();
+}
+
+void Pool::process(std::string_view path, luban::Toolkit &toolkit) {
+  std::ifstream reader(std::string(path), std::ios::in);
+  if (!reader) {
+    std::cerr << "read pool data file: " << path << " error" << std::endl;
+    exit(-1);
+  }
+  m_capacity = count_lines(path);
+  m_data = alloc_rows(m_capacity);
+  std::string line;
+  uint64_t ukey;
+  while (std::getline(reader, line)) {
+    auto ss = split(line, '\t');
+    if (ss.size() != 2) {
+      continue;
+    }
+    if (m_key_type == LONGMEN_KEY_UINT64) {
+      if (!parse_key(ss[0], ukey)) {
+        std::cerr << "pool key: " << ss[0] << " is not uint64" << std::endl;
+        continue;
+      }
+      m_ukeys.push_back(ukey);
+    } else {
+      m_keys.push_back(ss[0]);
+    }
+    luban::SharedFeaturesPtr features =
+        std::make_shared<luban::Features>(ss[1]);
+    add_attributes(*features);
+    auto rows = toolkit.process_item(features);
+    append(*rows);
+  }
+  reader.close();
+  seal_attributes();
+}
+
+void Pool::map(std::string_view path) {
+  int fd = open(std::string(path).c_str(), O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    std::cerr << "read pool data file: " << path << " error" << std::endl;
+    exit(-1);
+  }
+  m_map_bytes = st.st_size;
+  if (m_map_bytes > 0) {
+    void *data = mmap(nullptr, m_map_bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      std::cerr << "map pool data file: " << path << " error" << std::endl;
+      exit(-1);
+    }
+    m_map = (char *)data;
+    madvise(m_map, m_map_bytes, MADV_SEQUENTIAL);
+  }
+  close(fd);
+
+  // the lines of the eager load, only their keys are parsed. the features
+  // are parsed too when they have attributes to index
+  const char *end = m_map + m_map_bytes;
+  uint64_t ukey;
+  for (const char *line = m_map; line < end;) {
+    const char *eol = (const char *)memchr(line, '\n', end - line);
+    eol = eol == nullptr ? end : eol;
+    std::string_view text(line, eol - line);
+    uint64_t offset = line - m_map;
+    line = eol == end ? end : eol + 1;
+    size_t tab = text.find('\t');
+    if (tab == std::string_view::npos || tab + 1 == text.size() ||
+        text.find('\t', tab + 1) != std::string_view::npos) {
+      continue;
+    }
+    std::string_view key = text.substr(0, tab);
+    if (m_key_type == LONGMEN_KEY_UINT64) {
+      if (!parse_key(key, ukey)) {
+        std::cerr << "pool key: " << key << " is not uint64" << std::endl;
+        continue;
+      }
+      m_ukeys.push_back(ukey);
+    }
+    if (!m_attributes.empty()) {
+      luban::Features features(std::string(text.substr(tab + 1)));
+      add_attributes(features);
+    }
+    m_blobs.push_back(Blob{offset, uint32_t(tab), uint32_t(text.size())});
+    m_size++;
+  }
+  if (m_map != nullptr) {
+    // lookups read single lines from now on
+    madvise(m_map, m_map_bytes, MADV_RANDOM);
+  }
+  seal_attributes();
+}
+
+RowCache::Row Pool::process_row(int64_t index) const {
+  auto &blob = m_blobs[index];
+  const char *line = m_map + blob.offset;
+  luban::SharedFeaturesPtr features = std::make_shared<luban::Features>(
+      std::string(line + blob.key_len + 1, blob.len - blob.key_len - 1));
+  auto rows = m_toolkit->process_item(features);
+  char *data = new char[std::max<int64_t>(m_row_bytes, 1)];
+  encode(*rows, data);
+  return RowCache::Row(data, std::default_delete<char[]>());
+}
+
+Pool::RowRef Pool::fetch(int64_t index) const {
+  if (m_cache == nullptr) {
+    return {row(index), nullptr};
+  }
+  auto cached = m_cache->get(index);
+  if (cached == nullptr) {
+    // processed outside the shard lock, a concurrent miss of the same item
+    // keeps whichever row was cached first
+    cached = m_cache->put(index, process_row(index));
+  }
+  return {cached.get(), cached};
+}
+
+void Pool::seal_attributes() {
+  for (auto &attr : m_attributes) {
+    for (auto &value : attr.second) {
+      value.second.seal(m_size);
+    }
+  }
+}
+
+#define POOL_CACHE_MAGIC 0x31304c4f4f504d4cULL // "LMPOOL01"
+
+namespace {
+
+template <typename T> void write_pod(std::ostream &out, const T &value) {
+  out.write((const char *)&value, sizeof(T));
+}
+
+template <typename T> bool read_pod(std::istream &in, T &value) {
+  return bool(in.read((char *)&value, sizeof(T)));
+}
+
+void write_string(std::ostream &out, const std::string &value) {
+  write_pod(out, uint32_t(value.size()));
+  out.write(value.data(), value.size());
+}
+
+// bytes left in the file, counts read from it are checked against them
+// before anything is allocated for them
+uint64_t remaining(std::istream &in, uint64_t file_size) {
+  int64_t pos = in.tellg();
+  return pos < 0 || uint64_t(pos) > file_size ? 0 : file_size - pos;
+}
+
+bool read_string(std::istream &in, uint64_t file_size, std::string &value) {
+  uint32_t len;
+  if (!read_pod(in, len) || len > remaining(in, file_size)) {
+    return false;
+  }
+  value.resize(len);
+  return bool(in.read(value.data(), len));
+}
+
+} // namespace
+
+bool Pool::load_cache(const std::string &path) {
+  std::error_code error;
+  uint64_t file_size = std::filesystem::file_size(path, error);
+  if (error) {
+    return false;
+  }
+  std::ifstream in(path, std::ios::binary);
+  uint64_t magic;
+  int64_t size, row_bytes;
+  int key_type;
+  if (!in || !read_pod(in, magic) || magic != POOL_CACHE_MAGIC ||
+      !read_pod(in, size) || !read_pod(in, row_bytes) ||
+      !read_pod(in, key_type) || row_bytes != m_row_bytes ||
+      key_type != m_key_type || size < 0) {
+    return false;
+  }
+  // every row takes its data and at least a u64 or a string length, a
+  // corrupt size is rejected before the rows are allocated
+  uint64_t per_row = uint64_t(row_bytes) + sizeof(uint32_t);
+  if (uint64_t(size) > remaining(in, file_size) / per_row) {
+    return false;
+  }
+
+  std::vector<std::string> keys;
+  std::vector<uint64_t> ukeys;
+  if (key_type == LONGMEN_KEY_UINT64) {
+    ukeys.resize(size);
+    if (!in.read((char *)ukeys.data(), size * sizeof(uint64_t))) {
+      return false;
+    }
+  } else {
+    keys.resize(size);
+    for (auto &key : keys) {
+      if (!read_string(in, file_size, key)) {
+        return false;
+      }
+    }
+  }
+  char *data = alloc_rows(size);
+  if (!in.read(data, size * row_bytes)) {
+    page_free(data);
+    return false;
+  }
+
+  Attributes attributes;
+  uint64_t n_attributes;
+  bool ok = read_pod(in, n_attributes);
+  for (uint64_t i = 0; ok && i < n_attributes; i++) {
+    std::string name;
+    uint64_t n_values;
+    ok = read_string(in, file_size, name) && read_pod(in, n_values);
+    for (uint64_t j = 0; ok && j < n_values; j++) {
+      std::string value;
+      uint64_t n_rows;
+      ok = read_string(in, file_size, value) && read_pod(in, n_rows) &&
+           n_rows <= remaining(in, file_size) / sizeof(uint32_t);
+      std::vector<uint32_t> rows(ok ? n_rows : 0);
+      ok = ok && in.read((char *)rows.data(), n_rows * sizeof(uint32_t));
+      auto &set = attributes[name][value];
+      for (uint32_t row : rows) {
+        set.add(row);
+      }
+      set.seal(size);
+    }
+  }
+  // the attribute names are part of the cache key
+  if (!ok) {
+    page_free(data);
+    return false;
+  }
+
+  m_size = size;
+  m_capacity = size;
+  m_data = data;
+  m_keys = std::move(keys);
+  m_ukeys = std::move(ukeys);
+  for (auto &attr : attributes) {
+    m_attributes[attr.first] = std::move(attr.second);
+  }
+  return true;
+}
+
+void Pool::save_cache(const std::string &path) const {
+  // written aside and renamed, so readers never see a partial cache
+  std::string tmp = temp_path(path);
+  {
+    std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+    write_pod(out, POOL_CACHE_MAGIC);
+    write_pod(out, m_size);
+    write_pod(out, m_row_bytes);
+    write_pod(out, m_key_type);
+    if (m_key_type == LONGMEN_KEY_UINT64) {
+      out.write((const char *)m_ukeys.data(), m_size * sizeof(uint64_t));
+    } else {
+      for (auto &key : m_keys) {
+        write_string(out, key);
+      }
+    }
+    out.write(m_data, m_size * m_row_bytes);
+    write_pod(out, uint64_t(m_attributes.size()));
+    for (auto &attr : m_attributes) {
+      write_string(out, attr.first);
+      write_pod(out, uint64_t(attr.second.size()));
+      for (auto &value : attr.second) {
+        auto rows = value.second.rows(m_size);
+        write_string(out, value.first);
+        write_pod(out, uint64_t(rows.size()));
+        out.write((const char *)rows.data(), rows.size() * sizeof(uint32_t));
+      }
+    }
+    if (!out) {
+      std::cerr << "write pool cache: " << tmp << " error" << std::endl;
+      std::remove(tmp.c_str());
+      return;
+    }
+  }
+  std::rename(tmp.c_str(), path.c_str());
+}
+
+namespace {
+
+std::mutex g_shared_mutex;
+std::unordered_map<std::string, std::weak_ptr<Pool>> g_shared_pools;
+
+} // namespace
+
+std::string Pool::share_key(uint64_t pool_hash, uint64_t toolkit_hash,
+                            const longmen_options_t &options) {
+  std::ostringstream key;
+  key << pool_hash << "|" << toolkit_hash << "|" << options.key_type << "|"
+      << options.huge_page << "|" << options.numa << "|"
+      << options.float_store << "|" << options.lazy_rows << "|";
+  if (options.attributes != nullptr && options.attributes_len > 0) {
+    key << std::string_view(options.attributes, options.attributes_len);
+  }
+  return key.str();
+}
+
+std::shared_ptr<Pool> Pool::find_shared(const std::string &key) {
+  std::lock_guard<std::mutex> lock(g_shared_mutex);
+  auto it = g_shared_pools.find(key);
+  return it == g_shared_pools.end() ? nullptr : it->second.lock();
+}
+
+std::shared_ptr<Pool> Pool::share(const std::string &key,
+                                  std::shared_ptr<Pool> pool) {
+  std::lock_guard<std::mutex> lock(g_shared_mutex);
+  for (auto it = g_shared_pools.begin(); it != g_shared_pools.end();) {
+    it = it->second.expired() ? g_shared_pools.erase(it) : std::next(it);
+  }
+  auto shared = g_shared_pools[key].lock();
+  if (shared != nullptr) {
+    return shared;
+  }
+  g_shared_pools[key] = pool;
+  return pool;
+}
+
+Pool::~Pool() {
+  // replicas are distinct, the other policies share one buffer
+  for (size_t i = 0; i < m_node_data.size(); i++) {
+    if (i == 0 || m_node_data[i] != m_node_data[0]) {
+      page_free(m_node_data[i]);
+    }
+  }
+  for (size_t i = 0; i < m_node_tower.size(); i++) {
+    if (i == 0 || m_node_tower[i] != m_node_tower[0]) {
+      page_free(m_node_tower[i]);
+    }
+  }
+  m_data = nullptr;
+  m_tower = nullptr;
+  if (m_map != nullptr) {
+    munmap(m_map, m_map_bytes);
+    m_map = nullptr;
+  }
+}
+
+void *Pool::place(const void *src, size_t bytes, int node) {
+  // the policies are set before the first touch, which is the copy
+  void *data = page_alloc(bytes, m_huge_page);
+  if (data == nullptr) {
+    std::cerr << "alloc pool data: " << bytes << " bytes error" << std::endl;
+    exit(-1);
+  }
+  if (node >= 0) {
+    bind_node(data, bytes, node);
+  } else if (m_numa == LONGMEN_NUMA_INTERLEAVE) {
+    interleave_nodes(data, bytes);
+  }
+  if (src != nullptr && bytes > 0) {
+    memcpy(data, src, bytes);
+  }
+  return data;
+}
+
+char *Pool::alloc_rows(int64_t rows) {
+  // replicas copy the rows of the first node once they are loaded
+  return (char *)place(nullptr, rows * m_row_bytes,
+                       m_numa == LONGMEN_NUMA_REPLICATE ? 0 : -1);
+}
+
+void Pool::replicate_rows() {
+  m_node_data.assign(node_count(), m_data);
+  if (m_numa != LONGMEN_NUMA_REPLICATE) {
+    return;
+  }
+  size_t bytes = m_size * m_row_bytes;
+  for (size_t n = 1; n < m_node_data.size(); n++) {
+    m_node_data[n] = (char *)place(m_data, bytes, n);
+  }
+}
+
+void Pool::alloc_tower(int64_t dim) {
+  m_tower_dim = dim;
+  m_tower_stride = (dim + 15) / 16 * 16;
+  size_t bytes = m_size * m_tower_stride * sizeof(float);
+  // page allocations are zeroed, the padding stays zero so it can take part
+  // in dot products
+  m_tower = (float *)place(nullptr, bytes, -1);
+  m_node_tower.assign(node_count(), m_tower);
+}
+
+void Pool::replicate_tower() {
+  if (m_numa != LONGMEN_NUMA_REPLICATE || m_tower == nullptr) {
+    return;
+  }
+  size_t bytes = m_size * m_tower_stride * sizeof(float);
+  for (size_t n = 0; n < m_node_tower.size(); n++) {
+    m_node_tower[n] = (float *)place(m_tower, bytes, n);
+  }
+  page_free(m_tower);
+  m_tower = m_node_tower[0];
+}
+
+void Pool::append(luban::Rows &rows) {
+  if (m_size == m_capacity) {
+    // the file grew after its lines were counted
+    m_capacity = m_capacity == 0 ? 1024 : m_capacity * 2;
+    char *data = alloc_rows(m_capacity);
+    if (m_size > 0) {
+      memcpy(data, m_data, m_size * m_row_bytes);
+    }
+    page_free(m_data);
+    m_data = data;
+  }
+  encode(rows, m_data + m_size * m_row_bytes);
+  m_size++;
+}
+
+void Pool::encode(luban::Rows &rows, char *dst) const {
+  for (size_t i = 0; i < m_indexes.size(); i++) {
+    auto &g = m_groups[i];
+    const char *src = rows.m_rows[m_indexes[i]]->m_data;
+    const float *values = (const float *)src;
+    char *out = dst + g.offset;
+    switch (g.store) {
+    case LONGMEN_STORE_FP16:
+      for (int64_t k = 0; k < g.floats; k++) {
+        ((uint16_t *)out)[k] = to_half(values[k]);
+      }
+      break;
+    case LONGMEN_STORE_BF16:
+      for (int64_t k = 0; k < g.floats; k++) {
+        ((uint16_t *)out)[k] = to_bf16(values[k]);
+      }
+      break;
+    case LONGMEN_STORE_INT8: {
+      // symmetric, one scale per group and row stored ahead of the values
+      float max = 0;
+      for (int64_t k = 0; k < g.floats; k++) {
+        max = std::max(max, std::fabs(values[k]));
+      }
+      float scale = max / 127.0f;
+      memcpy(out, &scale, sizeof(float));
+      int8_t *q = (int8_t *)(out + sizeof(float));
+      for (int64_t k = 0; k < g.floats; k++) {
+        q[k] = scale == 0 ? 0 : int8_t(std::lrintf(values[k] / scale));
+      }
+      break;
+    }
+    default:
+      memcpy(out, src, g.bytes);
+    }
+  }
+}
+
+void Pool::gather(const RowRef &row, size_t group, char *dst) const {
+  auto &g = m_groups[group];
+  const char *src = row.data + g.offset;
+  float *out = (float *)dst;
+  // plain loops over the group, the compiler vectorizes the decoding
+  switch (g.store) {
+  case LONGMEN_STORE_FP16: {
+    const uint16_t *in = (const uint16_t *)src;
+    for (int64_t k = 0; k < g.floats; k++) {
+      out[k] = from_half(in[k]);
+    }
+    break;
+  }
+  case LONGMEN_STORE_BF16: {
+    const uint16_t *in = (const uint16_t *)src;
+    for (int64_t k = 0; k < g.floats; k++) {
+      out[k] = from_bf16(in[k]);
+    }
+    break;
+  }
+  case LONGMEN_STORE_INT8: {
+    float scale;
+    memcpy(&scale, src, sizeof(float));
+    const int8_t *in = (const int8_t *)(src + sizeof(float));
+    for (int64_t k = 0; k < g.floats; k++) {
+      out[k] = float(in[k]) * scale;
+    }
+    break;
+  }
+  default:
+    memcpy(dst, src, g.bytes);
+  }
+}
+
+void Pool::add_attributes(luban::Features &features) {
+  for (auto &attr : m_attributes) {
+    auto value = features[attr.first];
+    if (value == nullptr) {
+      continue;
+    }
+    // int and string values, or lists of them for multi valued attributes
+    auto &values = attr.second;
+    std::visit(
+        [&](auto &&v) {
+          using T = std::decay_t<decltype(v)>;
+          if constexpr (std::is_same_v<T, int64_t>) {
+            values[std::to_string(v)].add(m_size);
+          } else if constexpr (std::is_same_v<T, std::string>) {
+            values[v].add(m_size);
+          } else if constexpr (std::is_same_v<T, std::vector<int64_t>>) {
+            for (auto &x : v) {
+              values[std::to_string(x)].add(m_size);
+            }
+          } else if constexpr (std::is_same_v<T, std::vector<std::string>>) {
+            for (auto &x : v) {
+              values[x].add(m_size);
+            }
+          }
+        },
+        *value);
+  }
+}
+
+void Pool::build_index() {
+  uint64_t capacity = 16;
+  while (capacity < uint64_t(m_size) * 2) {
+    capacity <<= 1;
+  }
+  m_mask = capacity - 1;
+  m_slots.assign(capacity, Slot{0, -1});
+
+  bool ukey = m_key_type == LONGMEN_KEY_UINT64;
+  for (int64_t r = 0; r < m_size; r++) {
+    uint64_t hash = ukey ? hash_key(m_ukeys[r]) : hash_key(key_at(r));
+    uint64_t pos = hash & m_mask;
+    while (m_slots[pos].row != -1) {
+      // later lines overwrite earlier ones with the same key
+      int64_t prev = m_slots[pos].row;
+      if (m_slots[pos].hash == hash &&
+          (ukey ? m_ukeys[prev] == m_ukeys[r] : key_at(prev) == key_at(r))) {
+        break;
+      }
+      pos = (pos + 1) & m_mask;
+    }
+    m_slots[pos] = Slot{hash, r};
+  }
+}
+
+int64_t Pool::probe(uint64_t hash, std::string_view key) const {
+  uint64_t pos = hash & m_mask;
+  while (m_slots[pos].row != -1) {
+    if (m_slots[pos].hash == hash && key_at(m_slots[pos].row) == key) {
+      return m_slots[pos].row;
+    }
+    pos = (pos + 1) & m_mask;
+  }
+  return -1;
+}
+
+int64_t Pool::probe(uint64_t hash, uint64_t key) const {
+  uint64_t pos = hash & m_mask;
+  while (m_slots[pos].row != -1) {
+    if (m_slots[pos].hash == hash && m_ukeys[m_slots[pos].row] == key) {
+      return m_slots[pos].row;
+    }
+    pos = (pos + 1) & m_mask;
+  }
+  return -1;
+}
+
+void Pool::prefetch_key(uint64_t hash) const {
+  // the slot was prefetched earlier, the key it points to is one more
+  // dependent miss in the probe, a heap string or a line of the mapped file
+  auto &slot = m_slots[hash & m_mask];
+  if (slot.row == -1 || slot.hash != hash) {
+    return;
+  }
+  if (m_key_type == LONGMEN_KEY_UINT64) {
+    __builtin_prefetch(&m_ukeys[slot.row], 0, 1);
+  } else {
+    __builtin_prefetch(key_at(slot.row).data(), 0, 1);
+  }
+}
+
+void Pool::prefetch_row(int64_t index) const {
+  if (m_cache != nullptr) {
+    return;
+  }
+  char *data = row(index);
+  for (int64_t off = 0; off < m_row_bytes; off += 64) {
+    __builtin_prefetch(data + off, 0, 1);
+  }
+}
+
+int64_t Pool::find(std::string_view key) const {
+  if (m_key_type == LONGMEN_KEY_UINT64) {
+    uint64_t value;
+    return parse_key(key, value) ? find(value) : -1;
+  }
+  return probe(hash_key(key), key);
+}
+
+int64_t Pool::find(uint64_t key) const {
+  if (m_key_type != LONGMEN_KEY_UINT64) {
+    char buf[24];
+    auto ret = std::to_chars(buf, buf + sizeof(buf), key);
+    return find(std::string_view{buf, size_t(ret.ptr - buf)});
+  }
+  return probe(hash_key(key), key);
+}
+
+int Pool::key(int64_t index, char *buf, int cap) const {
+  if (index < 0 || index >= m_size) {
+    return -1;
+  }
+  if (m_key_type == LONGMEN_KEY_UINT64) {
+    auto ret = std::to_chars(buf, buf + cap, m_ukeys[index]);
+    return ret.ec == std::errc() ? int(ret.ptr - buf) : -1;
+  }
+  auto key = key_at(index);
+  if (key.size() > size_t(cap)) {
+    return -1;
+  }
+  memcpy(buf, key.data(), key.size());
+  return key.size();
+}
+
+template <typename Probe>
+void Pool::lookup(const uint64_t *hashes, int size, int64_t *rows,
+                  Probe &&probe) const {
+  for (int i = 0; i < size && i < POOL_PREFETCH_DISTANCE; i++) {
+    __builtin_prefetch(&m_slots[hashes[i] & m_mask], 0, 1);
+  }
+  for (int i = 0; i < size; i++) {
+    if (i + POOL_PREFETCH_DISTANCE < size) {
+      __builtin_prefetch(&m_slots[hashes[i + POOL_PREFETCH_DISTANCE] & m_mask],
+                         0, 1);
+    }
+    if (i + POOL_PREFETCH_DISTANCE / 2 < size) {
+      prefetch_key(hashes[i + POOL_PREFETCH_DISTANCE / 2]);
+    }
+    rows[i] = probe(i);
+    if (rows[i] >= 0) {
+      // the gather stage reads the row soon after the lookup finishes
+      prefetch_row(rows[i]);
+    }
+  }
+}
+
+template <typename Key>
+void Pool::lookup(Key &&key, int size, int64_t *rows) const {
+  thread_local std::vector<uint64_t> hashes;
+  hashes.resize(size);
+  if (m_key_type == LONGMEN_KEY_UINT64) {
+    thread_local std::vector<uint64_t> keys;
+    keys.resize(size);
+    for (int i = 0; i < size; i++) {
+      if (!parse_key(key(i), keys[i])) {
+        // never matches: the slot probe is skipped below
+        hashes[i] = 0;
+        rows[i] = -1;
+        continue;
+      }
+      hashes[i] = hash_key(keys[i]);
+      rows[i] = 0;
+    }
+    lookup(hashes.data(), size, rows, [&](int i) -> int64_t {
+      return rows[i] < 0 ? -1 : probe(hashes[i], keys[i]);
+    });
+    return;
+  }
+
+  for (int i = 0; i < size; i++) {
+    hashes[i] = hash_key(key(i));
+  }
+  lookup(hashes.data(), size, rows,
+         [&](int i) { return probe(hashes[i], key(i)); });
+}
+
+void Pool::lookup(char **items, int64_t *lens, int size, int64_t *rows) const {
+  lookup(
+      [&](int i) {
+        return std::string_view{items[i], size_t(lens[i])};
+      },
+      size, rows);
+}
+
+void Pool::lookup(char *items, int32_t *offsets, int size,
+                  int64_t *rows) const {
+  lookup(
+      [&](int i) {
+        return std::string_view{items + offsets[i],
+                                size_t(offsets[i + 1] - offsets[i])};
+      },
+      size, rows);
+}
+
+void Pool::lookup(uint64_t *items, int size, int64_t *rows) const {
+  if (m_key_type != LONGMEN_KEY_UINT64) {
+    for (int i = 0; i < size; i++) {
+      rows[i] = find(items[i]);
+    }
+    return;
+  }
+  thread_local std::vector<uint64_t> hashes;
+  hashes.resize(size);
+  for (int i = 0; i < size; i++) {
+    hashes[i] = hash_key(items[i]);
+  }
+  lookup(hashes.data(), size, rows,
+         [&](int i) { return probe(hashes[i], items[i]); });
+}
@@ -0,0 +1,82 @@
+#include "registry.h"
+
+#include <chrono>
+#include <deque>
+#include <thread>
+
+namespace {
+
+struct alignas(64) Slot {
+  // epoch pinned by the owning thread, 0 outside of calls
+  std::atomic<uint64_t> epoch{0};
+  std::atomic<bool> used{false};
+  // nested guards of the owning thread
+  int depth = 0;
+};
+
+std::atomic<uint64_t> g_epoch(1);
+std::mutex g_slots_mutex;
+// a deque keeps the slots in place as it grows
+std::deque<Slot> g_slots;
+
+// slot of a thread, handed to another thread when it exits
+struct SlotOwner {
+  Slot *slot;
+
+  SlotOwner() : slot(nullptr) {
+    std::lock_guard<std::mutex> lock(g_slots_mutex);
+    for (auto &s : g_slots) {
+      if (!s.used.exchange(true)) {
+        slot = &s;
+        return;
+      }
+    }
+    slot = &g_slots.emplace_back();
+    slot->used = true;
+  }
+
+  ~SlotOwner() { slot->used = false; }
+};
+
+thread_local SlotOwner t_slot;
+
+void wait() { std::this_thread::sleep_for(std::chrono::milliseconds(1)); }
+
+} // namespace
+
+EpochGuard::EpochGuard() {
+  Slot *slot = t_slot.slot;
+  if (slot->depth++ == 0) {
+    // sequentially consistent, so the publisher either sees the pin or the
+    // reader sees the model it published
+    slot->epoch.store(g_epoch.load());
+  }
+}
+
+EpochGuard::~EpochGuard() {
+  Slot *slot = t_slot.slot;
+  if (--slot->depth == 0) {
+    slot->epoch.store(0, std::memory_order_release);
+  }
+}
+
+void synchronize_epochs() {
+  uint64_t target = g_epoch.fetch_add(1) + 1;
+  for (;;) {
+    bool busy = false;
+    {
+      std::lock_guard<std::mutex> lock(g_slots_mutex);
+      for (auto &s : g_slots) {
+        uint64_t epoch = s.epoch.load();
+        if (epoch != 0 && epoch < target) {
+          busy = true;
+          break;
+        }
+      }
+    }
+    if (!busy) {
+      return;
+    }
+    wait();
+  }
+}
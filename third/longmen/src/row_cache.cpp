@@ -0,0 +1,79 @@
+#include "row_cache.h"
+
+#include <algorithm>
+#include <functional>
+
+RowCache::RowCache(int64_t capacity)
+    : m_capacity(std::max<int64_t>(capacity, ROW_CACHE_SHARDS)), m_size(0) {
+  for (int64_t i = 0; i < ROW_CACHE_SHARDS; i++) {
+    m_shards[i].capacity = m_capacity / ROW_CACHE_SHARDS +
+                           (i < m_capacity % ROW_CACHE_SHARDS ? 1 : 0);
+  }
+}
+
+RowCache::Row RowCache::get(int64_t index) {
+  auto &s = shard(index);
+  std::lock_guard<std::mutex> lock(s.mutex);
+  auto it = s.entries.find(index);
+  if (it == s.entries.end()) {
+    s.misses.fetch_add(1, std::memory_order_relaxed);
+    return nullptr;
+  }
+  s.hits.fetch_add(1, std::memory_order_relaxed);
+  it->second.hits++;
+  s.recency.splice(s.recency.begin(), s.recency, it->second.pos);
+  return it->second.row;
+}
+
+RowCache::Row RowCache::put(int64_t index, Row row) {
+  auto &s = shard(index);
+  std::lock_guard<std::mutex> lock(s.mutex);
+  auto it = s.entries.find(index);
+  if (it != s.entries.end()) {
+    return it->second.row;
+  }
+  if (int64_t(s.entries.size()) >= s.capacity) {
+    s.entries.erase(s.recency.back());
+    s.recency.pop_back();
+    m_size--;
+  }
+  s.recency.push_front(index);
+  s.entries[index] = Entry{row, 0, s.recency.begin()};
+  m_size++;
+  return row;
+}
+
+int64_t RowCache::hits() const {
+  int64_t n = 0;
+  for (auto &s : m_shards) {
+    n += s.hits.load(std::memory_order_relaxed);
+  }
+  return n;
+}
+
+int64_t RowCache::misses() const {
+  int64_t n = 0;
+  for (auto &s : m_shards) {
+    n += s.misses.load(std::memory_order_relaxed);
+  }
+  return n;
+}
+
+std::vector<std::pair<int64_t, int64_t>> RowCache::hot(int k) {
+  // sorted as (hits, row) pairs, returned as (row, hits)
+  std::vector<std::pair<int64_t, int64_t>> rows;
+  for (auto &s : m_shards) {
+    std::lock_guard<std::mutex> lock(s.mutex);
+    for (auto &entry : s.entries) {
+      rows.emplace_back(entry.second.hits, entry.first);
+    }
+  }
+  size_t n = std::min<size_t>(std::max(k, 0), rows.size());
+  std::partial_sort(rows.begin(), rows.begin() + n, rows.end(),
+                    std::greater<>());
+  rows.resize(n);
+  for (auto &row : rows) {
+    std::swap(row.first, row.second);
+  }
+  return rows;
+}
@@ -0,0 +1,142 @@
+#include "topology.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+#include <fstream>
+#include <sched.h>
+#include <sstream>
+#include <string>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+// from linux/mempolicy.h, numaif.h of libnuma is not required
+#define TOPOLOGY_MPOL_BIND 2
+#define TOPOLOGY_MPOL_INTERLEAVE 3
+
+thread_local int t_current_node = 0;
+
+namespace {
+
+// sysfs cpu and node lists, like 0-15,32-47
+std::vector<int> read_list(const std::string &path) {
+  std::vector<int> result;
+  std::ifstream reader(path);
+  std::string list, range;
+  if (!reader || !std::getline(reader, list)) {
+    return result;
+  }
+  std::istringstream ranges(list);
+  while (std::getline(ranges, range, ',')) {
+    size_t dash = range.find('-');
+    try {
+      int first = std::stoi(range.substr(0, dash));
+      int last = dash == std::string::npos ? first
+                                           : std::stoi(range.substr(dash + 1));
+      for (int i = first; i <= last; i++) {
+        result.push_back(i);
+      }
+    } catch (...) {
+      continue;
+    }
+  }
+  return result;
+}
+
+struct Topology {
+  // kernel node id of each dense node
+  std::vector<int> nodes;
+  // dense node of each cpu
+  std::vector<int> cpus;
+
+  Topology() {
+    for (int id : read_list("/sys/devices/system/node/online")) {
+      int node = nodes.size();
+      nodes.push_back(id);
+      for (int cpu : read_list("/sys/devices/system/node/node" +
+                               std::to_string(id) + "/cpulist")) {
+        if (size_t(cpu) >= cpus.size()) {
+          cpus.resize(cpu + 1, 0);
+        }
+        cpus[cpu] = node;
+      }
+    }
+    if (nodes.empty()) {
+      nodes.push_back(0);
+    }
+  }
+
+  static const Topology &get() {
+    static Topology topology;
+    return topology;
+  }
+};
+
+bool mbind(void *ptr, size_t len, int mode, const std::vector<int> &ids) {
+#ifdef SYS_mbind
+  std::vector<unsigned long> mask;
+  for (int id : ids) {
+    size_t word = id / (8 * sizeof(unsigned long));
+    if (word >= mask.size()) {
+      mask.resize(word + 1, 0);
+    }
+    mask[word] |= 1UL << (id % (8 * sizeof(unsigned long)));
+  }
+  unsigned long maxnode = mask.size() * 8 * sizeof(unsigned long) + 1;
+  return syscall(SYS_mbind, ptr, len, mode, mask.data(), maxnode, 0) == 0;
+#else
+  return false;
+#endif
+}
+
+} // namespace
+
+int node_count() { return Topology::get().nodes.size(); }
+
+void refresh_node() {
+  auto &topology = Topology::get();
+  int cpu = sched_getcpu();
+  t_current_node = cpu >= 0 && size_t(cpu) < topology.cpus.size()
+                       ? topology.cpus[cpu]
+                       : 0;
+}
+
+bool bind_node(void *ptr, size_t len, int node) {
+  auto &topology = Topology::get();
+  if (node < 0 || size_t(node) >= topology.nodes.size()) {
+    return false;
+  }
+  return mbind(ptr, len, TOPOLOGY_MPOL_BIND, {topology.nodes[node]});
+}
+
+bool interleave_nodes(void *ptr, size_t len) {
+  return mbind(ptr, len, TOPOLOGY_MPOL_INTERLEAVE, Topology::get().nodes);
+}
+
+bool cpu_has_bf16() {
+#if defined(__x86_64__) || defined(__i386__)
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid_count(1, 0, &eax, &ebx, &ecx, &edx) ||
+      !(ecx & (1u << 27))) {
+    // no OSXSAVE
+    return false;
+  }
+  unsigned int xcr0_lo, xcr0_hi;
+  __asm__("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+  // the opmask, ZMM upper halves and high ZMM state are enabled
+  if ((xcr0_lo & 0xe6) != 0xe6) {
+    return false;
+  }
+  if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+    return false;
+  }
+  bool amx = edx & (1u << 22);
+  if (!__get_cpuid_count(7, 1, &eax, &ebx, &ecx, &edx)) {
+    return amx;
+  }
+  return amx || (eax & (1u << 5));
+#else
+  return false;
+#endif
+}
@@ -0,0 +1,161 @@
+//
+// `LongMen` - 'Torch Model inference in c++'
+// Copyright (C) 2019 - present timepi <timepi123@gmail.com>
+// LongMen is provided under: GNU Affero General Public License (AGPL3.0)
+// https://www.gnu.org/licenses/agpl-3.0.html unless stated otherwise.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU Affero General Public License for more details.
+//
+//
+
+// decode_features against buffers encoded as codec.h documents them, and
+// against truncated ones and counts larger than the buffer
+
+#include "codec.h"
+
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace {
+
+int g_failures = 0;
+
+#define EXPECT(cond)                                                           \
+  do {                                                                         \
+    if (!(cond)) {                                                             \
+      std::cerr << __FILE__ << ":" << __LINE__ << ": " #cond << std::endl;     \
+      g_failures++;                                                            \
+    }                                                                          \
+  } while (0)
+
+class Writer {
+public:
+  template <typename T> Writer &put(T value) {
+    m_data.append((const char *)&value, sizeof(T));
+    return *this;
+  }
+
+  Writer &str(const std::string &value) {
+    put(uint32_t(value.size()));
+    m_data += value;
+    return *this;
+  }
+
+  Writer &name(uint8_t type, const std::string &name) {
+    put(type).put(uint16_t(name.size()));
+    m_data += name;
+    return *this;
+  }
+
+  std::string m_data;
+};
+
+std::string encoded() {
+  Writer w;
+  w.put(uint32_t(6));
+  w.name(luban::DataType::kInt64, "age").put(int64_t(42));
+  w.name(luban::DataType::kFloat32, "score").put(0.5f);
+  w.name(luban::DataType::kString, "city").str("beijing");
+  w.name(luban::DataType::kInt64s, "clicks")
+      .put(uint32_t(2))
+      .put(int64_t(7))
+      .put(int64_t(-1));
+  w.name(luban::DataType::kFloat32s, "emb").put(uint32_t(1)).put(1.5f);
+  w.name(luban::DataType::kStrings, "tags")
+      .put(uint32_t(2))
+      .str("a")
+      .str("bc");
+  return w.m_data;
+}
+
+template <typename T> const T *get(luban::Features &features, const char *k) {
+  auto value = features[k];
+  return value == nullptr ? nullptr : std::get_if<T>(value.get());
+}
+
+void test_round_trip() {
+  std::string data = encoded();
+  auto features = decode_features(data.data(), data.size());
+  EXPECT(features != nullptr);
+  if (features == nullptr) {
+    return;
+  }
+  auto age = get<int64_t>(*features, "age");
+  EXPECT(age != nullptr && *age == 42);
+  auto score = get<float>(*features, "score");
+  EXPECT(score != nullptr && *score == 0.5f);
+  auto city = get<std::string>(*features, "city");
+  EXPECT(city != nullptr && *city == "beijing");
+  auto clicks = get<std::vector<int64_t>>(*features, "clicks");
+  EXPECT(clicks != nullptr && *clicks == std::vector<int64_t>({7, -1}));
+  auto emb = get<std::vector<float>>(*features, "emb");
+  EXPECT(emb != nullptr && *emb == std::vector<float>({1.5f}));
+  auto tags = get<std::vector<std::string>>(*features, "tags");
+  EXPECT(tags != nullptr && *tags == std::vector<std::string>({"a", "bc"}));
+}
+
+void test_empty_lists() {
+  Writer w;
+  w.put(uint32_t(3));
+  w.name(luban::DataType::kInt64s, "clicks").put(uint32_t(0));
+  w.name(luban::DataType::kFloat32s, "emb").put(uint32_t(0));
+  w.name(luban::DataType::kStrings, "tags").put(uint32_t(0));
+  auto features = decode_features(w.m_data.data(), w.m_data.size());
+  EXPECT(features != nullptr);
+  if (features == nullptr) {
+    return;
+  }
+  auto clicks = get<std::vector<int64_t>>(*features, "clicks");
+  EXPECT(clicks != nullptr && clicks->empty());
+  auto emb = get<std::vector<float>>(*features, "emb");
+  EXPECT(emb != nullptr && emb->empty());
+  auto tags = get<std::vector<std::string>>(*features, "tags");
+  EXPECT(tags != nullptr && tags->empty());
+}
+
+void test_truncated() {
+  std::string data = encoded();
+  for (size_t len = 0; len < data.size(); len++) {
+    EXPECT(decode_features(data.data(), len) == nullptr);
+  }
+  data += '\0';
+  EXPECT(decode_features(data.data(), data.size()) == nullptr);
+}
+
+void test_oversized_counts() {
+  for (uint8_t type : {luban::DataType::kInt64s, luban::DataType::kFloat32s,
+                       luban::DataType::kStrings}) {
+    Writer w;
+    w.put(uint32_t(1)).name(type, "x").put(uint32_t(0xffffffff)).str("a");
+    EXPECT(decode_features(w.m_data.data(), w.m_data.size()) == nullptr);
+  }
+  Writer w;
+  w.put(uint32_t(0xffffffff)).name(luban::DataType::kInt64, "x");
+  EXPECT(decode_features(w.m_data.data(), w.m_data.size()) == nullptr);
+  w = Writer();
+  w.put(uint32_t(1)).name(luban::DataType::kString, "x").put(uint32_t(100));
+  EXPECT(decode_features(w.m_data.data(), w.m_data.size()) == nullptr);
+}
+
+} // namespace
+
+int main() {
+  test_round_trip();
+  test_empty_lists();
+  test_truncated();
+  test_oversized_counts();
+  if (g_failures > 0) {
+    std::cerr << g_failures << " failures" << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,178 @@
+//
+// `LongMen` - 'Torch Model inference in c++'
+// Copyright (C) 2019 - present timepi <timepi123@gmail.com>
+// LongMen is provided under: GNU Affero General Public License (AGPL3.0)
+// https://www.gnu.org/licenses/agpl-3.0.html unless stated otherwise.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU Affero General Public License for more details.
+//
+//
+
+// publishes through a handle while reader threads pin epochs and hold user
+// contexts across the publishes: a replaced model is freed before publish
+// returns, and not before the calls and contexts using it are gone
+
+#include "registry.h"
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <thread>
+#include <vector>
+
+#define TEST_MODELS 64
+#define TEST_READERS 8
+
+namespace {
+
+std::atomic<int> g_failures(0);
+
+#define EXPECT(cond)                                                           \
+  do {                                                                         \
+    if (!(cond)) {                                                             \
+      std::cerr << __FILE__ << ":" << __LINE__ << ": " #cond << std::endl;     \
+      g_failures++;                                                            \
+    }                                                                          \
+  } while (0)
+
+std::atomic<bool> g_freed[TEST_MODELS];
+
+// stands in for a Model, its contexts are counted like the user contexts
+struct Counted {
+  explicit Counted(int id) : id(id) {}
+  ~Counted() {
+    EXPECT(n.load() == 0);
+    g_freed[id] = true;
+  }
+  int64_t contexts() const { return n.load(); }
+
+  int id;
+  std::atomic<int64_t> n{0};
+};
+
+void reader(Handle<Counted> &handle, std::atomic<bool> &stop, unsigned seed) {
+  std::mt19937 rng(seed);
+  std::vector<Counted *> held;
+  while (!stop) {
+    {
+      // a context is created inside a call, like longmen_handle_user_ctx_new
+      EpochGuard guard;
+      Counted *model = handle.get();
+      if (model != nullptr) {
+        EXPECT(!g_freed[model->id]);
+        model->n++;
+        held.push_back(model);
+      }
+    }
+    // and dropped outside of any, some live through several publishes
+    while (held.size() > 8 || (!held.empty() && rng() % 4 == 0)) {
+      size_t i = rng() % held.size();
+      EXPECT(!g_freed[held[i]->id]);
+      held[i]->n--;
+      held[i] = held.back();
+      held.pop_back();
+    }
+    if (rng() % 16 == 0) {
+      std::this_thread::sleep_for(std::chrono::microseconds(rng() % 200));
+    }
+  }
+  for (Counted *model : held) {
+    model->n--;
+  }
+}
+
+void test_stress() {
+  for (auto &freed : g_freed) {
+    freed = false;
+  }
+  Handle<Counted> handle;
+  std::atomic<bool> stop(false);
+  std::vector<std::thread> readers;
+  for (int i = 0; i < TEST_READERS; i++) {
+    readers.emplace_back(reader, std::ref(handle), std::ref(stop), i);
+  }
+  for (int id = 0; id < TEST_MODELS; id++) {
+    handle.publish(new Counted(id));
+    EXPECT(id == 0 || g_freed[id - 1]);
+    EXPECT(!g_freed[id]);
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  stop = true;
+  for (auto &t : readers) {
+    t.join();
+  }
+  EXPECT(!g_freed[TEST_MODELS - 1]);
+  handle.publish(nullptr);
+  for (int id = 0; id < TEST_MODELS; id++) {
+    EXPECT(g_freed[id]);
+  }
+}
+
+void test_context_blocks_publish() {
+  g_freed[0] = false;
+  g_freed[1] = false;
+  Handle<Counted> handle;
+  handle.publish(new Counted(0));
+  Counted *model;
+  {
+    EpochGuard guard;
+    model = handle.get();
+    model->n++;
+  }
+  std::atomic<bool> published(false);
+  std::thread publisher([&]() {
+    handle.publish(new Counted(1));
+    published = true;
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  EXPECT(!published);
+  EXPECT(!g_freed[0]);
+  model->n--;
+  publisher.join();
+  EXPECT(g_freed[0]);
+  EXPECT(!g_freed[1]);
+}
+
+void test_guard_blocks_publish() {
+  g_freed[0] = false;
+  Handle<Counted> handle;
+  handle.publish(new Counted(0));
+  std::atomic<bool> published(false);
+  std::thread publisher;
+  {
+    EpochGuard guard;
+    EXPECT(handle.get() != nullptr);
+    publisher = std::thread([&]() {
+      handle.publish(nullptr);
+      published = true;
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    EXPECT(!published);
+    EXPECT(!g_freed[0]);
+  }
+  publisher.join();
+  EXPECT(g_freed[0]);
+}
+
+} // namespace
+
+int main() {
+  test_context_blocks_publish();
+  test_guard_blocks_publish();
+  test_stress();
+  if (g_failures > 0) {
+    std::cerr << g_failures << " failures" << std::endl;
+    return 1;
+  }
+  std::cout << "ok" << std::endl;
+  return 0;
+}
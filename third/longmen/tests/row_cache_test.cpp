@@ -0,0 +1,171 @@
+//
+// `LongMen` - 'Torch Model inference in c++'
+// Copyright (C) 2019 - present timepi <timepi123@gmail.com>
+// LongMen is provided under: GNU Affero General Public License (AGPL3.0)
+// https://www.gnu.org/licenses/agpl-3.0.html unless stated otherwise.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU Affero General Public License for more details.
+//
+//
+
+// RowCache capacity per shard, least recently used eviction within a shard,
+// the hit and miss counts, and rows held by readers outliving their eviction
+
+#include "row_cache.h"
+
+#include <cstring>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+namespace {
+
+int g_failures = 0;
+
+#define EXPECT(cond)                                                           \
+  do {                                                                         \
+    if (!(cond)) {                                                             \
+      std::cerr << __FILE__ << ":" << __LINE__ << ": " #cond << std::endl;     \
+      g_failures++;                                                            \
+    }                                                                          \
+  } while (0)
+
+// row holding its index, which sets *freed when the last holder drops it
+RowCache::Row make_row(int64_t index, bool *freed = nullptr) {
+  char *data = new char[sizeof(index)];
+  memcpy(data, &index, sizeof(index));
+  return RowCache::Row(data, [freed](const char *p) {
+    if (freed != nullptr) {
+      *freed = true;
+    }
+    delete[] p;
+  });
+}
+
+int64_t row_index(const RowCache::Row &row) {
+  int64_t index;
+  memcpy(&index, row.get(), sizeof(index));
+  return index;
+}
+
+void test_capacity() {
+  // raised to one row per shard
+  EXPECT(RowCache(0).m_capacity == ROW_CACHE_SHARDS);
+  EXPECT(RowCache(10).m_capacity == ROW_CACHE_SHARDS);
+
+  // the first two shards hold one row more
+  int64_t capacity = 2 * ROW_CACHE_SHARDS + 2;
+  int64_t rows = 10 * ROW_CACHE_SHARDS;
+  RowCache cache(capacity);
+  EXPECT(cache.m_capacity == capacity);
+  for (int64_t i = 0; i < rows; i++) {
+    cache.put(i, make_row(i));
+  }
+  EXPECT(cache.size() == capacity);
+  for (int64_t shard : {int64_t(0), int64_t(1), int64_t(2)}) {
+    int64_t held = 0;
+    for (int64_t i = shard; i < rows; i += ROW_CACHE_SHARDS) {
+      held += cache.get(i) != nullptr ? 1 : 0;
+    }
+    EXPECT(held == (shard < 2 ? 3 : 2));
+  }
+}
+
+void test_eviction_order() {
+  // three rows per shard, the rows below all fall in shard 0
+  RowCache cache(3 * ROW_CACHE_SHARDS);
+  const int64_t a = 0, b = ROW_CACHE_SHARDS, c = 2 * ROW_CACHE_SHARDS,
+                d = 3 * ROW_CACHE_SHARDS, e = 4 * ROW_CACHE_SHARDS;
+  cache.put(a, make_row(a));
+  cache.put(b, make_row(b));
+  cache.put(c, make_row(c));
+  // a is read again, b is the least recently used
+  EXPECT(cache.get(a) != nullptr);
+  cache.put(d, make_row(d));
+  EXPECT(cache.get(b) == nullptr);
+  EXPECT(cache.get(c) != nullptr);
+  EXPECT(cache.get(a) != nullptr);
+  EXPECT(cache.get(d) != nullptr);
+  // c was read before a and d, it goes next
+  cache.put(e, make_row(e));
+  EXPECT(cache.get(c) == nullptr);
+  for (int64_t i : {a, d, e}) {
+    auto row = cache.get(i);
+    EXPECT(row != nullptr && row_index(row) == i);
+  }
+  // the other shards are untouched
+  EXPECT(cache.size() == 3);
+}
+
+void test_put_keeps_first() {
+  RowCache cache(ROW_CACHE_SHARDS);
+  auto first = cache.put(7, make_row(7));
+  bool freed = false;
+  auto second = cache.put(7, make_row(7, &freed));
+  EXPECT(second == first);
+  EXPECT(freed);
+  EXPECT(cache.get(7) == first);
+}
+
+void test_counts() {
+  RowCache cache(ROW_CACHE_SHARDS);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([&cache]() {
+      for (int64_t i = 0; i < 1000; i++) {
+        if (cache.get(i % ROW_CACHE_SHARDS) == nullptr) {
+          cache.put(i % ROW_CACHE_SHARDS, make_row(i % ROW_CACHE_SHARDS));
+        }
+      }
+    });
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+  // one row per shard and every row fits, so only the first reads miss
+  EXPECT(cache.hits() + cache.misses() == 4000);
+  EXPECT(cache.misses() >= ROW_CACHE_SHARDS);
+  EXPECT(cache.misses() <= 4 * ROW_CACHE_SHARDS);
+
+  auto hot = cache.hot(3);
+  EXPECT(hot.size() == 3);
+  EXPECT(hot[0].second >= hot[1].second && hot[1].second >= hot[2].second);
+  EXPECT(cache.hot(-1).empty());
+}
+
+void test_row_outlives_eviction() {
+  RowCache cache(ROW_CACHE_SHARDS);
+  bool freed = false;
+  cache.put(5, make_row(5, &freed));
+  auto held = cache.get(5);
+  // one row per shard, the next row of the shard evicts it
+  cache.put(5 + ROW_CACHE_SHARDS, make_row(5 + ROW_CACHE_SHARDS));
+  EXPECT(cache.get(5) == nullptr);
+  EXPECT(!freed);
+  EXPECT(row_index(held) == 5);
+  held.reset();
+  EXPECT(freed);
+}
+
+} // namespace
+
+int main() {
+  test_capacity();
+  test_eviction_order();
+  test_put_keeps_first();
+  test_counts();
+  test_row_outlives_eviction();
+  if (g_failures > 0) {
+    std::cerr << g_failures << " failures" << std::endl;
+    return 1;
+  }
+  std::cout << "ok" << std::endl;
+  return 0;
+}
@@ -0,0 +1,628 @@
+//
+// `LongMen` - 'Torch Model inference in c++'
+// Copyright (C) 2019 - present timepi <timepi123@gmail.com>
+// LongMen is provided under: GNU Affero General Public License (AGPL3.0)
+// https://www.gnu.org/licenses/agpl-3.0.html unless stated otherwise.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU Affero General Public License for more details.
+//
+//
+
+// Throughput of longmen_forward_flat as the number of calling threads
+// grows, for each number of model replicas, to see where a shared module
+// stops scaling. With --numa, once per pool placement policy, each against
+// the same run with numa off.
+// With --parse, the time to parse user features instead: by luban, by
+// parse_features (simdjson when built with it) and from the binary
+// encoding. The blobs are captured ones given by --users, one json blob per
+// line, reported on average and for the median and the largest blob, or
+// else a synthetic typical blob and a worst case one of long lists and
+// escaped strings.
+
+#include "codec.h"
+#include "longmen.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+static const char *kUsage =
+    "usage: longmen_bench --pool=FILE --key=KEY --toolkit=FILE "
+    "--model=FILE --users=FILE\n"
+    "                     [--threads=1,2,4,8] [--replicas=1,8] "
+    "[--replica_policy=core|round_robin]\n"
+    "                     [--numa=off,interleave,replicate] [--items=N] "
+    "[--seconds=N]\n"
+    "       longmen_bench --parse [--users=FILE] [--seconds=N]\n";
+
+static std::map<std::string, std::string> parse_args(int argc, char **argv) {
+  std::map<std::string, std::string> args;
+  for (int i = 1; i < argc; i++) {
+    std::string arg(argv[i]);
+    size_t eq = arg.find('=');
+    if (arg.rfind("--", 0) != 0) {
+      std::cerr << kUsage;
+      exit(-1);
+    }
+    // flags without a value are set to ""
+    if (eq == std::string::npos) {
+      args[arg.substr(2)] = "";
+      continue;
+    }
+    args[arg.substr(2, eq - 2)] = arg.substr(eq + 1);
+  }
+  return args;
+}
+
+static std::vector<int> parse_numa(const std::string &list) {
+  std::vector<int> result;
+  std::istringstream reader(list);
+  std::string value;
+  while (std::getline(reader, value, ',')) {
+    if (value == "off") {
+      result.push_back(LONGMEN_NUMA_OFF);
+    } else if (value == "interleave") {
+      result.push_back(LONGMEN_NUMA_INTERLEAVE);
+    } else if (value == "replicate") {
+      result.push_back(LONGMEN_NUMA_REPLICATE);
+    } else {
+      std::cerr << kUsage;
+      exit(-1);
+    }
+  }
+  // off runs first, the others are reported against it
+  std::sort(result.begin(), result.end());
+  result.erase(std::unique(result.begin(), result.end()), result.end());
+  return result.empty() ? std::vector<int>{LONGMEN_NUMA_OFF} : result;
+}
+
+static std::vector<int> parse_list(const std::string &list,
+                                   std::vector<int> fallback) {
+  std::vector<int> result;
+  std::istringstream reader(list);
+  std::string value;
+  while (std::getline(reader, value, ',')) {
+    result.push_back(std::stoi(value));
+  }
+  return result.empty() ? fallback : result;
+}
+
+// the same user features as json and in the binary encoding of codec.h
+struct Blob {
+  std::string json;
+  std::string bin;
+
+  template <typename T> void put(T value) {
+    bin.append((const char *)&value, sizeof(T));
+  }
+
+  void put_str(const std::string &value) {
+    put(uint32_t(value.size()));
+    bin += value;
+  }
+
+  void begin(const std::string &name, int type) {
+    json += json.empty() ? "{" : ",";
+    json += "\"" + name + "\":{\"type\":" + std::to_string(type) +
+            ",\"value\":";
+    put(uint8_t(type));
+    put(uint16_t(name.size()));
+    bin += name;
+  }
+};
+
+// `fields` features of every type, lists of `list` values. escaped strings
+// make the json parsers unescape every value
+static Blob synthetic_features(int fields, int list, bool escaped) {
+  Blob blob;
+  std::string text = escaped ? "a\\\"b\\u00e9c" : "abc";
+  std::string raw = escaped ? "a\"b\u00e9c" : "abc";
+  blob.put(uint32_t(fields * 6));
+  for (int f = 0; f < fields; f++) {
+    std::string id = std::to_string(f);
+    blob.begin("i" + id, luban::DataType::kInt64);
+    blob.json += std::to_string(1000003 * f) + "}";
+    blob.put(int64_t(1000003 * f));
+    blob.begin("f" + id, luban::DataType::kFloat32);
+    blob.json += "0.125}";
+    blob.put(0.125f);
+    blob.begin("s" + id, luban::DataType::kString);
+    blob.json += "\"" + text + "\"}";
+    blob.put_str(raw);
+    blob.begin("il" + id, luban::DataType::kInt64s);
+    blob.put(uint32_t(list));
+    for (int i = 0; i < list; i++) {
+      blob.json += (i == 0 ? "[" : ",") + std::to_string(i * 7919);
+      blob.put(int64_t(i * 7919));
+    }
+    blob.json += list == 0 ? "[]}" : "]}";
+    blob.begin("fl" + id, luban::DataType::kFloat32s);
+    blob.put(uint32_t(list));
+    for (int i = 0; i < list; i++) {
+      blob.json += (i == 0 ? "[" : ",") + std::string("-1.5");
+      blob.put(-1.5f);
+    }
+    blob.json += list == 0 ? "[]}" : "]}";
+    blob.begin("sl" + id, luban::DataType::kStrings);
+    blob.put(uint32_t(list));
+    for (int i = 0; i < list; i++) {
+      blob.json += (i == 0 ? "[\"" : ",\"") + text + "\"";
+      blob.put_str(raw);
+    }
+    blob.json += list == 0 ? "[]}" : "]}";
+  }
+  blob.json += "}";
+  return blob;
+}
+
+// Binary encoding of captured json user features, which are only read in
+// the `{"name": {"type": t, "value": v}, ...}` layout parse_features takes.
+class JsonEncoder {
+public:
+  explicit JsonEncoder(const std::string &json)
+      : m_p(json.data()), m_end(json.data() + json.size()) {}
+
+  bool encode(std::string &bin) {
+    Blob blob;
+    uint32_t count = 0;
+    blob.put(count);
+    if (!eat('{')) {
+      return false;
+    }
+    if (eat('}')) {
+      bin = blob.bin;
+      return true;
+    }
+    do {
+      std::string name, key;
+      int64_t type = -1;
+      const char *value = nullptr;
+      if (!string(name) || !eat(':') || !eat('{')) {
+        return false;
+      }
+      do {
+        if (!string(key) || !eat(':')) {
+          return false;
+        }
+        space();
+        if (key == "type") {
+          std::string token;
+          if (!number(token)) {
+            return false;
+          }
+          type = std::strtoll(token.c_str(), nullptr, 10);
+        } else {
+          if (key == "value") {
+            value = m_p;
+          }
+          if (!skip()) {
+            return false;
+          }
+        }
+      } while (eat(','));
+      if (!eat('}') || type < 0 || type > 5 || value == nullptr ||
+          name.size() > UINT16_MAX) {
+        return false;
+      }
+      blob.put(uint8_t(type));
+      blob.put(uint16_t(name.size()));
+      blob.bin += name;
+      // the value is read again once its type is known
+      const char *next = m_p;
+      m_p = value;
+      if (!encode_value(int(type), blob)) {
+        return false;
+      }
+      m_p = next;
+      count++;
+    } while (eat(','));
+    if (!eat('}')) {
+      return false;
+    }
+    memcpy(&blob.bin[0], &count, sizeof(count));
+    bin = blob.bin;
+    return true;
+  }
+
+private:
+  void space() {
+    while (m_p < m_end && strchr(" \t\r\n", *m_p) != nullptr) {
+      m_p++;
+    }
+  }
+
+  bool eat(char c) {
+    space();
+    if (m_p < m_end && *m_p == c) {
+      m_p++;
+      return true;
+    }
+    return false;
+  }
+
+  bool number(std::string &token) {
+    space();
+    const char *start = m_p;
+    while (m_p < m_end && strchr("+-.eE0123456789", *m_p) != nullptr) {
+      m_p++;
+    }
+    token.assign(start, m_p);
+    return m_p > start;
+  }
+
+  static void utf8(uint32_t c, std::string &out) {
+    if (c < 0x80) {
+      out += char(c);
+    } else if (c < 0x800) {
+      out += char(0xc0 | (c >> 6));
+      out += char(0x80 | (c & 0x3f));
+    } else if (c < 0x10000) {
+      out += char(0xe0 | (c >> 12));
+      out += char(0x80 | ((c >> 6) & 0x3f));
+      out += char(0x80 | (c & 0x3f));
+    } else {
+      out += char(0xf0 | (c >> 18));
+      out += char(0x80 | ((c >> 12) & 0x3f));
+      out += char(0x80 | ((c >> 6) & 0x3f));
+      out += char(0x80 | (c & 0x3f));
+    }
+  }
+
+  bool hex4(uint32_t &c) {
+    if (m_end - m_p < 4) {
+      return false;
+    }
+    char digits[5] = {m_p[0], m_p[1], m_p[2], m_p[3], 0};
+    char *end;
+    c = uint32_t(std::strtoul(digits, &end, 16));
+    m_p += 4;
+    return end == digits + 4;
+  }
+
+  bool string(std::string &out) {
+    out.clear();
+    if (!eat('"')) {
+      return false;
+    }
+    while (m_p < m_end && *m_p != '"') {
+      char c = *m_p++;
+      if (c != '\\') {
+        out += c;
+        continue;
+      }
+      if (m_p == m_end) {
+        return false;
+      }
+      c = *m_p++;
+      uint32_t code;
+      switch (c) {
+      case 'b':
+        out += '\b';
+        break;
+      case 'f':
+        out += '\f';
+        break;
+      case 'n':
+        out += '\n';
+        break;
+      case 'r':
+        out += '\r';
+        break;
+      case 't':
+        out += '\t';
+        break;
+      case 'u':
+        if (!hex4(code)) {
+          return false;
+        }
+        // a surrogate pair is one code point
+        if (code >= 0xd800 && code < 0xdc00 && m_end - m_p >= 6 &&
+            m_p[0] == '\\' && m_p[1] == 'u') {
+          uint32_t low;
+          m_p += 2;
+          if (!hex4(low)) {
+            return false;
+          }
+          code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+        }
+        utf8(code, out);
+        break;
+      default:
+        out += c;
+      }
+    }
+    return eat('"');
+  }
+
+  bool skip() {
+    space();
+    if (m_p == m_end) {
+      return false;
+    }
+    std::string ignored;
+    if (*m_p == '"') {
+      return string(ignored);
+    }
+    if (*m_p == '{' || *m_p == '[') {
+      char close = *m_p == '{' ? '}' : ']';
+      m_p++;
+      if (eat(close)) {
+        return true;
+      }
+      do {
+        if (close == '}' && (!string(ignored) || !eat(':'))) {
+          return false;
+        }
+        if (!skip()) {
+          return false;
+        }
+      } while (eat(','));
+      return eat(close);
+    }
+    for (const char *word : {"true", "false", "null"}) {
+      size_t n = strlen(word);
+      if (size_t(m_end - m_p) >= n && memcmp(m_p, word, n) == 0) {
+        m_p += n;
+        return true;
+      }
+    }
+    return number(ignored);
+  }
+
+  bool scalar(int type, Blob &blob) {
+    std::string token;
+    if (type == luban::DataType::kString) {
+      if (!string(token)) {
+        return false;
+      }
+      blob.put_str(token);
+      return true;
+    }
+    if (!number(token)) {
+      return false;
+    }
+    if (type == luban::DataType::kInt64) {
+      blob.put(int64_t(std::strtoll(token.c_str(), nullptr, 10)));
+    } else {
+      blob.put(std::strtof(token.c_str(), nullptr));
+    }
+    return true;
+  }
+
+  bool encode_value(int type, Blob &blob) {
+    if (type < luban::DataType::kInt64s) {
+      return scalar(type, blob);
+    }
+    // lists hold the scalars of type - 3
+    Blob values;
+    uint32_t n = 0;
+    if (!eat('[')) {
+      return false;
+    }
+    if (!eat(']')) {
+      do {
+        if (!scalar(type - 3, values)) {
+          return false;
+        }
+        n++;
+      } while (eat(','));
+      if (!eat(']')) {
+        return false;
+      }
+    }
+    blob.put(n);
+    blob.bin += values.bin;
+    return true;
+  }
+
+  const char *m_p;
+  const char *m_end;
+};
+
+// microseconds per call of parse over the given time
+template <typename Parse> static double time_parse(Parse &&parse,
+                                                   double seconds) {
+  int64_t calls = 0;
+  auto start = std::chrono::steady_clock::now();
+  double elapsed = 0;
+  while (elapsed < seconds) {
+    for (int i = 0; i < 64; i++) {
+      if (parse() == nullptr) {
+        std::cerr << "user features rejected" << std::endl;
+        exit(-1);
+      }
+    }
+    calls += 64;
+    elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                            start)
+                  .count();
+  }
+  return elapsed * 1e6 / calls;
+}
+
+static int bench_parse(double seconds, const std::string &users) {
+  // each set of blobs is parsed in turn, its sizes are averaged
+  std::vector<std::pair<std::string, std::vector<Blob>>> sets;
+  if (users.empty()) {
+    sets = {{"typical", {synthetic_features(8, 16, false)}},
+            {"worst", {synthetic_features(32, 1024, true)}}};
+  } else {
+    std::vector<Blob> captured;
+    std::ifstream reader(users);
+    std::string line;
+    while (std::getline(reader, line)) {
+      Blob blob;
+      blob.json = line;
+      if (!JsonEncoder(line).encode(blob.bin)) {
+        std::cerr << "user " << captured.size() + 1
+                  << " is not {\"name\": {\"type\": t, \"value\": v}, ...}"
+                  << std::endl;
+        return -1;
+      }
+      captured.push_back(std::move(blob));
+    }
+    if (captured.empty()) {
+      std::cerr << "no users to parse" << std::endl;
+      return -1;
+    }
+    std::sort(captured.begin(), captured.end(),
+              [](const Blob &a, const Blob &b) {
+                return a.json.size() < b.json.size();
+              });
+    sets = {{"captured", captured},
+            {"median", {captured[captured.size() / 2]}},
+            {"largest", {captured.back()}}};
+  }
+  std::cout << "blobs\tjson bytes\tbin bytes\tluban us\tparse_features "
+               "us\tdecode_features us"
+            << std::endl;
+  for (auto &entry : sets) {
+    auto &blobs = entry.second;
+    size_t json_bytes = 0, bin_bytes = 0;
+    for (auto &blob : blobs) {
+      json_bytes += blob.json.size();
+      bin_bytes += blob.bin.size();
+    }
+    size_t i = 0;
+    double luban = time_parse(
+        [&]() {
+          auto &json = blobs[i++ % blobs.size()].json;
+          return std::make_shared<luban::Features>(std::string_view(json));
+        },
+        seconds);
+    double parse = time_parse(
+        [&]() {
+          auto &json = blobs[i++ % blobs.size()].json;
+          return parse_features(json.data(), json.size());
+        },
+        seconds);
+    double decode = time_parse(
+        [&]() {
+          auto &bin = blobs[i++ % blobs.size()].bin;
+          return decode_features(bin.data(), bin.size());
+        },
+        seconds);
+    std::cout << entry.first << "\t" << json_bytes / blobs.size() << "\t"
+              << bin_bytes / blobs.size() << "\t" << luban << "\t" << parse
+              << "\t" << decode << std::endl;
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  auto args = parse_args(argc, argv);
+  double seconds = args["seconds"].empty() ? 10 : std::stod(args["seconds"]);
+  if (args.count("parse")) {
+    return bench_parse(seconds, args["users"]);
+  }
+  for (auto name : {"pool", "key", "toolkit", "model", "users"}) {
+    if (args[name].empty()) {
+      std::cerr << kUsage;
+      return -1;
+    }
+  }
+  int cores = std::max(1u, std::thread::hardware_concurrency());
+  auto threads = parse_list(args["threads"], {1, 2, 4, cores});
+  auto replicas = parse_list(args["replicas"], {1, cores});
+  auto numa = parse_numa(args["numa"]);
+  int policy = args["replica_policy"] == "round_robin"
+                   ? LONGMEN_REPLICA_ROUND_ROBIN
+                   : LONGMEN_REPLICA_CORE;
+  size_t items_per_call =
+      args["items"].empty() ? 200 : std::stoul(args["items"]);
+
+  // the first items of the pool, scored by every call
+  std::ifstream pool(args["pool"]);
+  std::string line, items;
+  std::vector<int32_t> offsets{0};
+  while (offsets.size() <= items_per_call && std::getline(pool, line)) {
+    items += line.substr(0, line.find('\t'));
+    offsets.push_back(items.size());
+  }
+  std::vector<std::string> users;
+  std::ifstream reader(args["users"]);
+  while (std::getline(reader, line)) {
+    users.push_back(line);
+  }
+  if (users.empty() || offsets.size() < 2) {
+    std::cerr << "no users or items to score" << std::endl;
+    return -1;
+  }
+  int n_items = offsets.size() - 1;
+
+  const char *numa_names[] = {"off", "interleave", "replicate"};
+  // calls/s with numa off, by replicas and threads
+  std::map<std::pair<int, int>, double> baseline;
+  std::cout << "numa\treplicas\tthreads\tcalls/s\titems/s\tvs off"
+            << std::endl;
+  for (int policy_numa : numa) {
+    for (int r : replicas) {
+      longmen_options_t options = {
+          LONGMEN_KEY_STRING, 0, 0, 0, nullptr, 0, LONGMEN_HUGEPAGE_OFF,
+          policy_numa, LONGMEN_STORE_FP32, LONGMEN_PRECISION_FP32,
+          LONGMEN_BACKEND_AUTO, r, policy, nullptr, 0, 0, 0};
+      auto &p = args["pool"], &k = args["key"], &t = args["toolkit"],
+           &m = args["model"];
+      void *model = longmen_new_model(
+          (char *)p.data(), p.size(), (char *)k.data(), k.size(),
+          (char *)t.data(), t.size(), (char *)m.data(), m.size(), &options);
+
+      for (int n : threads) {
+        std::atomic<bool> stop(false);
+        std::atomic<int64_t> calls(0);
+        std::vector<std::thread> workers;
+        for (int i = 0; i < n; i++) {
+          workers.emplace_back([&, i]() {
+            std::vector<float> scores(n_items);
+            for (size_t j = i; !stop; j++) {
+              auto &user = users[j % users.size()];
+              longmen_forward_flat(model, (char *)user.data(), user.size(),
+                                   items.data(), offsets.data(), n_items,
+                                   scores.data());
+              calls++;
+            }
+          });
+        }
+        auto start = std::chrono::steady_clock::now();
+        std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+        stop = true;
+        for (auto &w : workers) {
+          w.join();
+        }
+        double elapsed = std::chrono::duration<double>(
+                             std::chrono::steady_clock::now() - start)
+                             .count();
+        double rate = calls / elapsed;
+        if (policy_numa == LONGMEN_NUMA_OFF) {
+          baseline[{r, n}] = rate;
+        }
+        std::cout << numa_names[policy_numa] << "\t" << r << "\t" << n << "\t"
+                  << rate << "\t" << rate * n_items << "\t";
+        if (baseline.count({r, n})) {
+          std::cout << rate / baseline[{r, n}] << "x";
+        } else {
+          std::cout << "-";
+        }
+        std::cout << std::endl;
+      }
+      longmen_del_model(model);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,166 @@
+//
+// `LongMen` - 'Torch Model inference in c++'
+// Copyright (C) 2019 - present timepi <timepi123@gmail.com>
+// LongMen is provided under: GNU Affero General Public License (AGPL3.0)
+// https://www.gnu.org/licenses/agpl-3.0.html unless stated otherwise.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as
+// published by the Free Software Foundation.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+// GNU Affero General Public License for more details.
+//
+//
+
+// Score drift of a cheaper setup against the fp32 one, like a quantized
+// pool or model: both are loaded side by side, a sample of the pool is
+// scored for every user of the users file (one json per line) and the score
+// deltas are reported.
+
+#include "longmen.h"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+static const char *kUsage =
+    "usage: longmen_compare --pool=FILE --key=KEY --toolkit=FILE "
+    "--model=FILE --users=FILE\n"
+    "                       [--float_store=fp32|fp16|bf16|int8] "
+    "[--variant_model=FILE] [--samples=N]\n";
+
+static std::map<std::string, std::string> parse_args(int argc, char **argv) {
+  std::map<std::string, std::string> args;
+  for (int i = 1; i < argc; i++) {
+    std::string arg(argv[i]);
+    size_t eq = arg.find('=');
+    if (arg.rfind("--", 0) != 0 || eq == std::string::npos) {
+      std::cerr << kUsage;
+      exit(-1);
+    }
+    args[arg.substr(2, eq - 2)] = arg.substr(eq + 1);
+  }
+  return args;
+}
+
+static int parse_store(const std::string &store) {
+  if (store == "fp16") {
+    return LONGMEN_STORE_FP16;
+  } else if (store == "bf16") {
+    return LONGMEN_STORE_BF16;
+  } else if (store == "int8") {
+    return LONGMEN_STORE_INT8;
+  }
+  return LONGMEN_STORE_FP32;
+}
+
+static void *load(std::map<std::string, std::string> &args,
+                  const std::string &model, int float_store) {
+  longmen_options_t options = {
+      LONGMEN_KEY_STRING, 0, 0, 0, nullptr, 0, LONGMEN_HUGEPAGE_OFF,
+      LONGMEN_NUMA_OFF, float_store, LONGMEN_PRECISION_FP32,
+      LONGMEN_BACKEND_AUTO, 0, LONGMEN_REPLICA_CORE, nullptr, 0, 0, 0};
+  auto &pool = args["pool"], &key = args["key"], &toolkit = args["toolkit"];
+  return longmen_new_model((char *)pool.data(), pool.size(),
+                           (char *)key.data(), key.size(),
+                           (char *)toolkit.data(), toolkit.size(),
+                           (char *)model.data(), model.size(), &options);
+}
+
+// keys of a uniform sample of the pool, the same for every run
+static std::vector<std::string> sample_keys(const std::string &path,
+                                            size_t samples) {
+  std::vector<std::string> keys;
+  std::ifstream reader(path);
+  std::mt19937_64 rng(0);
+  std::string line;
+  for (size_t seen = 0; std::getline(reader, line); seen++) {
+    std::string key = line.substr(0, line.find('\t'));
+    if (keys.size() < samples) {
+      keys.push_back(key);
+      continue;
+    }
+    size_t pos = rng() % (seen + 1);
+    if (pos < samples) {
+      keys[pos] = key;
+    }
+  }
+  return keys;
+}
+
+int main(int argc, char **argv) {
+  auto args = parse_args(argc, argv);
+  for (auto name : {"pool", "key", "toolkit", "model", "users"}) {
+    if (args[name].empty()) {
+      std::cerr << kUsage;
+      return -1;
+    }
+  }
+  size_t samples =
+      args["samples"].empty() ? 1000 : std::stoul(args["samples"]);
+  void *base = load(args, args["model"], LONGMEN_STORE_FP32);
+  // the variant model defaults to the base one, e.g. a quantized model
+  // made by tools/quantize.py
+  std::string variant_model =
+      args["variant_model"].empty() ? args["model"] : args["variant_model"];
+  void *variant = load(args, variant_model, parse_store(args["float_store"]));
+
+  auto keys = sample_keys(args["pool"], samples);
+  std::string items;
+  std::vector<int32_t> offsets{0};
+  for (auto &key : keys) {
+    items += key;
+    offsets.push_back(items.size());
+  }
+
+  std::ifstream users(args["users"]);
+  std::string user;
+  std::vector<float> base_scores(keys.size()), variant_scores(keys.size());
+  std::vector<double> deltas;
+  double base_sum = 0;
+  while (std::getline(users, user) && !keys.empty()) {
+    longmen_forward_flat(base, user.data(), user.size(), items.data(),
+                         offsets.data(), keys.size(), base_scores.data());
+    longmen_forward_flat(variant, user.data(), user.size(), items.data(),
+                         offsets.data(), keys.size(), variant_scores.data());
+    for (size_t i = 0; i < keys.size(); i++) {
+      if (base_scores[i] == LONGMEN_SCORE_MISSING) {
+        continue;
+      }
+      deltas.push_back(std::fabs(double(variant_scores[i]) - base_scores[i]));
+      base_sum += std::fabs(base_scores[i]);
+    }
+  }
+  if (deltas.empty()) {
+    std::cerr << "no scores to compare" << std::endl;
+    return -1;
+  }
+
+  double sum = 0;
+  for (double d : deltas) {
+    sum += d;
+  }
+  std::sort(deltas.begin(), deltas.end());
+  auto quantile = [&](double q) {
+    return deltas[std::min(deltas.size() - 1, size_t(q * deltas.size()))];
+  };
+  std::cout << "scores: " << deltas.size() << "\n"
+            << "mean |delta|: " << sum / deltas.size() << "\n"
+            << "relative mean |delta|: " << sum / std::max(base_sum, 1e-12)
+            << "\n"
+            << "p50 |delta|: " << quantile(0.5) << "\n"
+            << "p99 |delta|: " << quantile(0.99) << "\n"
+            << "max |delta|: " << deltas.back() << std::endl;
+
+  longmen_del_model(base);
+  longmen_del_model(variant);
+  return 0;
+}
@@ -0,0 +1,33 @@
+#
+# `LongMen` - 'Torch Model inference in c++'
+# Copyright (C) 2019 - present timepi <timepi123@gmail.com>
+# LongMen is provided under: GNU Affero General Public License (AGPL3.0)
+# https://www.gnu.org/licenses/agpl-3.0.html unless stated otherwise.
+#
+"""Dynamic int8 quantization of the linear layers of a TorchScript model.
+
+The weights of every linear layer reached from `forward` are quantized to
+int8 ahead of time, activations are quantized on the fly. The output is
+served through the `quantized` model config, check its score drift with
+`longmen_compare --variant_model=...` first.
+
+usage: python quantize.py model.pt model.int8.pt
+"""
+
+import sys
+
+import torch
+from torch.ao.quantization import default_dynamic_qconfig, quantize_dynamic_jit
+
+
+def main():
+    if len(sys.argv) != 3:
+        print(__doc__)
+        sys.exit(-1)
+    model = torch.jit.load(sys.argv[1]).eval()
+    quantized = quantize_dynamic_jit(model, {"": default_dynamic_qconfig})
+    torch.jit.save(quantized, sys.argv[2])
+
+
+if __name__ == "__main__":
+    main()
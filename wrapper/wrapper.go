@@ -12,62 +12,419 @@ package wrapper
 import "C"
 
 import (
+	"errors"
 	"reflect"
+	"strings"
+	"sync"
 	"unsafe"
 
+	"github.com/uopensail/longmen/config"
 	"github.com/uopensail/ulib/prome"
-	"github.com/uopensail/ulib/utils"
+	"github.com/uopensail/ulib/zlog"
+	"go.uber.org/zap"
 )
 
+// Wrapper is a loaded model. It is served once published to a Handle,
+// which owns and frees it from then on.
 type Wrapper struct {
-	utils.Reference
 	Ptr unsafe.Pointer
 }
 
-func NewWrapper(poolPath, keyField, lubanCfgPath, modelPath string) *Wrapper {
+// NewWrapper loads a model over the pool. poolHash is a content hash of the
+// pool file, 0 when the caller has none.
+func NewWrapper(poolPath string, poolHash uint64, lubanCfgPath, modelPath string, pconf *config.PoolConfig, mconf *config.ModelConfig) *Wrapper {
+	keyField := pconf.Key
+	var opts C.longmen_options_t
+	opts.key_type = C.LONGMEN_KEY_STRING
+	if pconf.KeyType == config.KeyTypeUint64 {
+		opts.key_type = C.LONGMEN_KEY_UINT64
+	}
+	switch pconf.HugePage {
+	case config.HugePageMadvise:
+		opts.huge_page = C.LONGMEN_HUGEPAGE_MADVISE
+	case config.HugePageHugetlb:
+		opts.huge_page = C.LONGMEN_HUGEPAGE_HUGETLB
+	default:
+		opts.huge_page = C.LONGMEN_HUGEPAGE_OFF
+	}
+	switch pconf.Numa {
+	case config.NumaInterleave:
+		opts.numa = C.LONGMEN_NUMA_INTERLEAVE
+	case config.NumaReplicate:
+		opts.numa = C.LONGMEN_NUMA_REPLICATE
+	default:
+		opts.numa = C.LONGMEN_NUMA_OFF
+	}
+	switch pconf.FloatStore {
+	case config.FloatStoreFp16:
+		opts.float_store = C.LONGMEN_STORE_FP16
+	case config.FloatStoreBf16:
+		opts.float_store = C.LONGMEN_STORE_BF16
+	case config.FloatStoreInt8:
+		opts.float_store = C.LONGMEN_STORE_INT8
+	default:
+		opts.float_store = C.LONGMEN_STORE_FP32
+	}
+	switch mconf.Precision {
+	case config.PrecisionBf16:
+		opts.precision = C.LONGMEN_PRECISION_BF16
+	case config.PrecisionAuto:
+		opts.precision = C.LONGMEN_PRECISION_AUTO
+	default:
+		opts.precision = C.LONGMEN_PRECISION_FP32
+	}
+	switch mconf.Backend {
+	case config.BackendTorchScript:
+		opts.backend = C.LONGMEN_BACKEND_TORCHSCRIPT
+	case config.BackendOnnx:
+		opts.backend = C.LONGMEN_BACKEND_ONNX
+	default:
+		opts.backend = C.LONGMEN_BACKEND_AUTO
+	}
+	opts.replicas = C.int(mconf.Replicas)
+	opts.replica_policy = C.LONGMEN_REPLICA_CORE
+	if mconf.ReplicaPolicy == config.ReplicaPolicyRoundRobin {
+		opts.replica_policy = C.LONGMEN_REPLICA_ROUND_ROBIN
+	}
+	opts.ann_m = C.int(mconf.Ann.M)
+	opts.ann_ef_construction = C.int(mconf.Ann.EfConstruction)
+	opts.ann_ef = C.int(mconf.Ann.Ef)
+	if len(pconf.Attributes) > 0 {
+		attributes := strings.Join(pconf.Attributes, ",")
+		opts.attributes = C.CString(attributes)
+		opts.attributes_len = C.int(len(attributes))
+		defer C.free(unsafe.Pointer(opts.attributes))
+	}
+	if len(pconf.CacheDir) > 0 {
+		opts.cache_dir = C.CString(pconf.CacheDir)
+		opts.cache_dir_len = C.int(len(pconf.CacheDir))
+		defer C.free(unsafe.Pointer(opts.cache_dir))
+	}
+	opts.lazy_rows = C.int(pconf.LazyRows)
+	opts.pool_hash = C.uint64_t(poolHash)
 	model := C.longmen_new_model((*C.char)(unsafe.Pointer(&s2b(poolPath)[0])), C.int(len(poolPath)),
 		(*C.char)(unsafe.Pointer(&s2b(keyField)[0])), C.int(len(keyField)),
 		(*C.char)(unsafe.Pointer(&s2b(lubanCfgPath)[0])), C.int(len(lubanCfgPath)),
-		(*C.char)(unsafe.Pointer(&s2b(modelPath)[0])), C.int(len(modelPath)))
-	w := &Wrapper{
-		Ptr: model,
+		(*C.char)(unsafe.Pointer(&s2b(modelPath)[0])), C.int(len(modelPath)), &opts)
+	w := &Wrapper{Ptr: model}
+	reportHugePages()
+	zlog.LOG.Info("model loaded", zap.String("path", modelPath),
+		zap.String("describe", w.Describe()))
+	return w
+}
+
+// Close frees a wrapper which was never published
+func (w *Wrapper) Close() {
+	if w.Ptr != nil {
+		C.longmen_del_model(w.Ptr)
+		w.Ptr = nil
 	}
+}
 
-	w.CloseHandler = func() {
-		if w.Ptr != nil {
-			C.longmen_del_model(w.Ptr)
-			w.Ptr = nil
-		}
+// Handle serves the last published wrapper. The calls pin an epoch of
+// their thread in the library rather than counting references, so they
+// do not contend with each other, and a replaced model is freed once the
+// calls and user contexts using it are done.
+type Handle struct {
+	Ptr unsafe.Pointer
+}
+
+func NewHandle() *Handle {
+	return &Handle{Ptr: C.longmen_handle_new()}
+}
+
+// Publish serves w from now on, blocking until the previous wrapper is
+// freed. The handle owns w afterwards, it must not be closed.
+func (h *Handle) Publish(w *Wrapper) {
+	C.longmen_handle_publish(h.Ptr, w.Ptr)
+}
+
+// Unpublish frees the served wrapper once the calls and user contexts using
+// it are done. The handle itself is kept, requests that resolved it before
+// get no user context from it from now on.
+func (h *Handle) Unpublish() {
+	C.longmen_handle_publish(h.Ptr, nil)
+}
+
+// Close frees the handle and the wrapper it serves. Nothing may call the
+// handle afterwards, or still be calling it.
+func (h *Handle) Close() {
+	if h.Ptr != nil {
+		C.longmen_handle_del(h.Ptr)
+		h.Ptr = nil
 	}
-	return w
 }
 
-func (w *Wrapper) Close() {
-	w.Reference.LazyFree(1)
+// flatItems holds the item ids back to back for longmen_forward_ctx,
+// it is reused across requests so the hot path does not allocate
+type flatItems struct {
+	data    []byte
+	offsets []int32
 }
 
-func (w *Wrapper) Rank(userFeatureJson string, itemIds []string) []float32 {
-	stat := prome.NewStat("Wrapper.Rank")
-	defer stat.End()
-	w.Retain()
-	defer w.Release()
+var flatItemsPool = sync.Pool{
+	New: func() interface{} {
+		return &flatItems{}
+	},
+}
 
-	items := make([]*C.char, len(itemIds))
-	lens := make([]int, len(itemIds))
+func (f *flatItems) reset(itemIds []string) {
+	f.data = f.data[:0]
+	f.offsets = append(f.offsets[:0], 0)
 	for i := 0; i < len(itemIds); i++ {
-		items[i] = (*C.char)(unsafe.Pointer(&s2b(itemIds[i])[0]))
-		lens[i] = len(itemIds[i])
+		f.data = append(f.data, itemIds[i]...)
+		f.offsets = append(f.offsets, int32(len(f.data)))
+	}
+	if len(f.data) == 0 {
+		// keep &f.data[0] valid when every id is empty
+		f.data = append(f.data, 0)
+	}
+}
+
+// UserContext holds the processed user features of one request, so the
+// request can be fanned out over several Rank calls paying the user side once.
+// It keeps its model alive until Close is called.
+type UserContext struct {
+	Ptr    unsafe.Pointer
+	model  unsafe.Pointer
+	u64Key bool
+}
+
+func newUserContext(ptr unsafe.Pointer) *UserContext {
+	model := C.longmen_user_ctx_model(ptr)
+	return &UserContext{
+		Ptr:    ptr,
+		model:  model,
+		u64Key: C.longmen_key_type(model) == C.LONGMEN_KEY_UINT64,
 	}
+}
+
+func (h *Handle) NewUserContext(userFeatureJson string) *UserContext {
+	stat := prome.NewStat("Wrapper.NewUserContext")
+	defer stat.End()
+	ptr := C.longmen_handle_user_ctx_new(h.Ptr, (*C.char)(unsafe.Pointer(&s2b(userFeatureJson)[0])),
+		C.int(len(userFeatureJson)))
+	if ptr == nil {
+		stat.MarkErr()
+		return nil
+	}
+	return newUserContext(ptr)
+}
+
+func (h *Handle) NewUserContextBin(userFeatures []byte) *UserContext {
+	stat := prome.NewStat("Wrapper.NewUserContextBin")
+	defer stat.End()
+	ptr := C.longmen_handle_user_ctx_new_bin(h.Ptr, (*C.char)(unsafe.Pointer(&userFeatures[0])),
+		C.int(len(userFeatures)))
+	if ptr == nil {
+		stat.MarkErr()
+		return nil
+	}
+	return newUserContext(ptr)
+}
+
+// NewUserContextFromRows reuses user features processed by another model,
+// nil if the toolkits of the two models differ
+func (h *Handle) NewUserContextFromRows(rows *UserRows) *UserContext {
+	ptr := C.longmen_handle_user_ctx_from_rows(h.Ptr, rows.Ptr)
+	if ptr == nil {
+		return nil
+	}
+	return newUserContext(ptr)
+}
+
+// UserRows are the processed user features of a context, kept after the
+// context is closed until Close is called
+type UserRows struct {
+	Ptr unsafe.Pointer
+}
+
+func (ctx *UserContext) Rows() *UserRows {
+	return &UserRows{Ptr: C.longmen_user_rows_new(ctx.Ptr)}
+}
+
+func (rows *UserRows) Close() {
+	if rows.Ptr != nil {
+		C.longmen_user_rows_del(rows.Ptr)
+		rows.Ptr = nil
+	}
+}
+
+// FilteredScore is the score of the items excluded by the filter
+const FilteredScore = float32(-C.FLT_MAX)
+
+// MissingScore is the score of the items not found in the pool
+const MissingScore = float32(C.LONGMEN_SCORE_MISSING)
+
+// SetFilter restricts the ranked and retrieved items to those whose pool
+// attributes match the filter, e.g. `region=cn|us&stock!=0`.
+// Excluded items are never scored and get FilteredScore.
+func (ctx *UserContext) SetFilter(filter string) error {
+	var ptr *C.char
+	if len(filter) > 0 {
+		ptr = (*C.char)(unsafe.Pointer(&s2b(filter)[0]))
+	}
+	if C.longmen_user_ctx_filter(ctx.Ptr, ptr, C.int(len(filter))) != 0 {
+		return errors.New("invalid filter: " + filter)
+	}
+	return nil
+}
+
+func (ctx *UserContext) Rank(itemIds []string) []float32 {
+	stat := prome.NewStat("UserContext.Rank")
+	defer stat.End()
+
+	items := flatItemsPool.Get().(*flatItems)
+	defer flatItemsPool.Put(items)
+	items.reset(itemIds)
 
 	scores := make([]float32, len(itemIds))
-	C.longmen_forward(w.Ptr, (*C.char)(unsafe.Pointer(&s2b(userFeatureJson)[0])),
-		C.int(len(userFeatureJson)), unsafe.Pointer(&items[0]), unsafe.Pointer(&lens[0]),
+	dup := C.longmen_forward_ctx(ctx.Ptr, (*C.char)(unsafe.Pointer(&items.data[0])),
+		(*C.int32_t)(unsafe.Pointer(&items.offsets[0])),
 		C.int(len(itemIds)), (*C.float)(unsafe.Pointer(&scores[0])))
 
 	stat.SetCounter(len(itemIds))
+	reportDuplicates("UserContext.Rank.Duplicates", int(dup))
 	return scores
 }
 
+func (ctx *UserContext) RankU64(itemIds []uint64) []float32 {
+	stat := prome.NewStat("UserContext.RankU64")
+	defer stat.End()
+
+	scores := make([]float32, len(itemIds))
+	dup := C.longmen_forward_ctx_u64(ctx.Ptr, (*C.uint64_t)(unsafe.Pointer(&itemIds[0])),
+		C.int(len(itemIds)), (*C.float)(unsafe.Pointer(&scores[0])))
+
+	stat.SetCounter(len(itemIds))
+	reportDuplicates("UserContext.RankU64.Duplicates", int(dup))
+	return scores
+}
+
+// Describe returns the inputs and outputs of the model as the backend
+// sees them
+func (w *Wrapper) Describe() string {
+	buf := make([]byte, 4096)
+	n := int(C.longmen_describe(w.Ptr, (*C.char)(unsafe.Pointer(&buf[0])), C.int(len(buf))))
+	if n > len(buf) {
+		buf = make([]byte, n)
+		n = int(C.longmen_describe(w.Ptr, (*C.char)(unsafe.Pointer(&buf[0])), C.int(len(buf))))
+	}
+	if n < 0 {
+		return ""
+	}
+	return string(buf[:n])
+}
+
+// reportHugePages records the bytes of the pool and workspace buffers and
+// how many of them the kernel backs with huge pages
+func reportHugePages() {
+	var allocated, backed C.int64_t
+	C.longmen_hugepage_stats(&allocated, &backed)
+	stat := prome.NewStat("Wrapper.PageBytes")
+	stat.SetCounter(int(allocated))
+	stat.End()
+	stat = prome.NewStat("Wrapper.HugePageBytes")
+	stat.SetCounter(int(backed))
+	stat.End()
+}
+
+// PoolStats are the processed items of a lazy pool
+type PoolStats struct {
+	Processed int64
+	Capacity  int64
+	Hits      int64
+	Misses    int64
+}
+
+// PoolStats of the served model, zero unless its pool is lazy
+func (h *Handle) PoolStats() PoolStats {
+	var processed, capacity, hits, misses C.int64_t
+	C.longmen_handle_pool_stats(h.Ptr, &processed, &capacity, &hits, &misses)
+	return PoolStats{
+		Processed: int64(processed),
+		Capacity:  int64(capacity),
+		Hits:      int64(hits),
+		Misses:    int64(misses),
+	}
+}
+
+// PoolHot returns the k most read items held by a lazy pool, one
+// `key\thits` line each
+func (h *Handle) PoolHot(k int) string {
+	buf := make([]byte, 64*k+1)
+	n := int(C.longmen_handle_pool_hot(h.Ptr, C.int(k), (*C.char)(unsafe.Pointer(&buf[0])), C.int(len(buf))))
+	if n > len(buf) {
+		buf = make([]byte, n)
+		n = int(C.longmen_handle_pool_hot(h.Ptr, C.int(k), (*C.char)(unsafe.Pointer(&buf[0])), C.int(len(buf))))
+	}
+	if n < 0 {
+		return ""
+	}
+	if n > len(buf) {
+		// the cache changed between the two calls
+		n = len(buf)
+	}
+	return string(buf[:n])
+}
+
+// reportDuplicates counts the candidates that repeated an earlier one and
+// were scored once, against the Rank counter it gives the duplicate rate
+func reportDuplicates(name string, dup int) {
+	stat := prome.NewStat(name)
+	defer stat.End()
+	stat.SetCounter(dup)
+}
+
+// Retrieve scores the whole pool for the user and returns the top k items
+// in descending order of score, two tower models only
+func (ctx *UserContext) Retrieve(k int) ([]string, []float32) {
+	stat := prome.NewStat("UserContext.Retrieve")
+	defer stat.End()
+	if k <= 0 {
+		return nil, nil
+	}
+	// k comes from the request, nothing beyond the pool is allocated
+	if size := int(C.longmen_pool_size(ctx.model)); k > size {
+		k = size
+	}
+	if k == 0 {
+		return nil, nil
+	}
+
+	rows := make([]int64, k)
+	scores := make([]float32, k)
+	n := int(C.longmen_retrieve(ctx.Ptr, C.int(k), (*C.int64_t)(unsafe.Pointer(&rows[0])),
+		(*C.float)(unsafe.Pointer(&scores[0]))))
+
+	itemIds := make([]string, 0, n)
+	itemScores := make([]float32, 0, n)
+	buf := make([]byte, 256)
+	for i := 0; i < n; i++ {
+		l := int(C.longmen_pool_key(ctx.model, C.int64_t(rows[i]),
+			(*C.char)(unsafe.Pointer(&buf[0])), C.int(len(buf))))
+		if l < 0 {
+			stat.MarkErr()
+			continue
+		}
+		itemIds = append(itemIds, string(buf[:l]))
+		itemScores = append(itemScores, scores[i])
+	}
+	stat.SetCounter(len(itemIds))
+	return itemIds, itemScores
+}
+
+func (ctx *UserContext) U64Key() bool {
+	return ctx.u64Key
+}
+
+func (ctx *UserContext) Close() {
+	if ctx.Ptr != nil {
+		C.longmen_user_ctx_del(ctx.Ptr)
+		ctx.Ptr = nil
+	}
+}
+
 func s2b(s string) (b []byte) {
 	/* #nosec G103 */
 	bh := (*reflect.SliceHeader)(unsafe.Pointer(&b))